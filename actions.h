@@ -22,9 +22,19 @@
 
 #include <stdbool.h>
 
-bool log_in (const char * name, const char * password);
+typedef void (* log_in_cb) (bool success, void * data);
+typedef void (* lock_cb) (bool locked, void * data);
+
+/* in j-login, data is the greeter_t the login was made on */
+void log_in (const char * name, const char * password, log_in_cb callback,
+ void * data);
 void do_sleep (void);
 void queue_shutdown (void);
 void queue_reboot (void);
+void lock_all (lock_cb callback, void * data);
+char * describe_sessions (void); /* free with g_free */
+char * describe_metrics (void); /* free with g_free */
+bool activate_session (const char * user);
+void grab_blocked (void); /* in j-login-greeter only */
 
 #endif
@@ -0,0 +1,202 @@
+/*
+ * J-Login - config.c
+ * Copyright 2019 John Lindgren
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions, and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions, and the following disclaimer in the documentation
+ *    provided with the distribution.
+ *
+ * This software is provided "as is" and without any warranty, express or
+ * implied. In no event shall the authors be liable for any damages arising from
+ * the use of this software.
+ */
+
+/* The configuration is a GKeyFile with a single [J-Login] group, read from
+ * $J_LOGIN_CONFIG if set (for test runs) and CONFIG_FILE otherwise.  Missing
+ * keys keep their defaults.  j-login watches the file with inotify and reloads
+ * it whenever it changes, including when an editor replaces it by renaming;
+ * it then tells the greeters to reload it too. */
+
+#include <stdlib.h>
+#include <string.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+
+#include <glib.h>
+#include <glib-unix.h>
+
+#include "config.h"
+#include "utils.h"
+
+#define GROUP "J-Login"
+#define DEFAULT_X_ARGS "-nolisten tcp -background none"
+
+const config_t * config;
+
+static const char * config_file = CONFIG_FILE;
+static char * file_name;
+static config_cb changed_callback;
+static unsigned reload_source;
+
+static int get_int (GKeyFile * file, const char * key, int value, int min) {
+   GError * error = NULL;
+   int got = g_key_file_get_integer (file, GROUP, key, & error);
+   if (error) {
+      /* a missing key is not worth a warning */
+      if (error->code != G_KEY_FILE_ERROR_KEY_NOT_FOUND &&
+       error->code != G_KEY_FILE_ERROR_GROUP_NOT_FOUND)
+         warning (error->message);
+      g_error_free (error);
+      return value;
+   }
+   return MAX (got, min);
+}
+
+static char * get_string (GKeyFile * file, const char * key, const char * value) {
+   char * got = g_key_file_get_string (file, GROUP, key, NULL);
+   char * copy = my_strdup ((got && got[0]) ? got : value);
+   g_free (got);
+   return copy;
+}
+
+static config_t * load (void) {
+   NEW (config_t, c, 1, 60, 60000, 10, 50, 20, 5000, 7, 0, NULL, NULL, NULL,
+    NULL, NULL, NULL, NULL, NULL, NULL, false);
+   GKeyFile * file = g_key_file_new ();
+   GError * error = NULL;
+   if (! g_key_file_load_from_file (file, config_file, G_KEY_FILE_NONE, & error)) {
+      if (error->code != G_FILE_ERROR_NOENT)
+         warning (error->message);
+      g_error_free (error);
+   }
+   c->spare_consoles = get_int (file, "SpareConsoles", c->spare_consoles, 0);
+   c->reap_delay = get_int (file, "ReapDelay", c->reap_delay, 1);
+   c->lock_delay = get_int (file, "LockDelay", c->lock_delay, 0);
+   c->lock_retry = get_int (file, "LockRetry", c->lock_retry, 1);
+   c->grab_tries = get_int (file, "GrabTries", c->grab_tries, 1);
+   c->grab_interval = get_int (file, "GrabInterval", c->grab_interval, 1);
+   c->switch_timeout = get_int (file, "SwitchTimeout", c->switch_timeout, 1);
+   c->first_vt = get_int (file, "FirstVT", c->first_vt, 1);
+   c->first_display = get_int (file, "FirstDisplay", c->first_display, 0);
+   char * x_args = g_key_file_get_string (file, GROUP, "XArguments", NULL);
+   if (! g_shell_parse_argv (x_args ? x_args : DEFAULT_X_ARGS, NULL, & c->x_args,
+    NULL))
+      c->x_args = g_new0 (char *, 1);
+   g_free (x_args);
+   char * background = g_key_file_get_string (file, GROUP, "Background", NULL);
+   if (background && background[0])
+      c->background = my_strdup (background);
+   g_free (background);
+   c->geometry = get_string (file, "Geometry", "1280x800");
+   c->greeter_user = get_string (file, "GreeterUser", "j-login");
+   c->backend = get_string (file, "Backend", "vt");
+   c->runtime_dir = get_string (file, "RuntimeDir", "/run");
+   c->state_dir = get_string (file, "StateDir", "/var/lib/j-login");
+   c->pam_service = get_string (file, "PamService", "login");
+   char * pam_conf_dir = g_key_file_get_string (file, GROUP, "PamConfDir", NULL);
+   if (pam_conf_dir && pam_conf_dir[0])
+      c->pam_conf_dir = my_strdup (pam_conf_dir);
+   g_free (pam_conf_dir);
+   c->headless = g_key_file_get_boolean (file, GROUP, "Headless", NULL);
+   g_key_file_free (file);
+   return c;
+}
+
+static void free_config (config_t * c) {
+   g_strfreev (c->x_args);
+   free (c->background);
+   free (c->geometry);
+   free (c->greeter_user);
+   free (c->backend);
+   free (c->runtime_dir);
+   free (c->state_dir);
+   free (c->pam_service);
+   free (c->pam_conf_dir);
+   free (c);
+}
+
+static void swap_strings (char * * a, char * * b) {
+   char * temp = * a;
+   * a = * b;
+   * b = temp;
+}
+
+void config_reload (void) {
+   if (reload_source) {
+      g_source_remove (reload_source);
+      reload_source = 0;
+   }
+   config_t * old = (config_t *) config;
+   config_t * c = load ();
+   /* keep what is fixed at startup; the new values are freed with old */
+   swap_strings (& c->backend, & old->backend);
+   swap_strings (& c->runtime_dir, & old->runtime_dir);
+   swap_strings (& c->state_dir, & old->state_dir);
+   swap_strings (& c->pam_service, & old->pam_service);
+   swap_strings (& c->pam_conf_dir, & old->pam_conf_dir);
+   c->headless = old->headless;
+   config = c;
+   if (changed_callback)
+      changed_callback (old);
+   free_config (old);
+}
+
+/* coalesces the several events of one save into a single reload */
+static int reload_cb (void * unused) {
+   (void) unused;
+   reload_source = 0;
+   config_reload ();
+   return G_SOURCE_REMOVE;
+}
+
+static int inotify_cb (int handle, GIOCondition condition, void * unused) {
+   (void) condition;
+   (void) unused;
+   char buf[4096] __attribute__ ((aligned (__alignof__ (struct inotify_event))));
+   int length = read (handle, buf, sizeof buf);
+   for (int pos = 0; pos < length; ) {
+      const struct inotify_event * event = (const void *) (buf + pos);
+      if (event->len && ! strcmp (event->name, file_name) && ! reload_source)
+         reload_source = g_timeout_add (100, reload_cb, NULL);
+      pos += sizeof (struct inotify_event) + event->len;
+   }
+   return G_SOURCE_CONTINUE;
+}
+
+/* changed may be NULL for a one-shot read */
+void config_init (config_cb changed) {
+   if (getenv ("J_LOGIN_CONFIG"))
+      config_file = getenv ("J_LOGIN_CONFIG");
+   config = load ();
+   changed_callback = changed;
+}
+
+/* the directory is watched rather than the file, which may not exist yet and
+ * is often replaced rather than written to */
+void config_watch (void) {
+   char * dir = g_path_get_dirname (config_file);
+   file_name = g_path_get_basename (config_file);
+   int handle = inotify_init1 (IN_NONBLOCK | IN_CLOEXEC);
+   if (handle < 0 || inotify_add_watch (handle, dir, IN_CLOSE_WRITE |
+    IN_MOVED_TO | IN_DELETE) < 0) {
+      warning ("cannot watch configuration file");
+      if (handle >= 0)
+         close (handle);
+   } else
+      g_unix_fd_add (handle, G_IO_IN, inotify_cb, NULL);
+   g_free (dir);
+}
+
+char * runtime_path (const char * name) {
+   return g_build_filename (config->runtime_dir, name, NULL);
+}
+
+char * state_path (const char * name) {
+   return g_build_filename (config->state_dir, name, NULL);
+}
@@ -0,0 +1,62 @@
+/*
+ * J-Login - config.h
+ * Copyright 2019 John Lindgren
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions, and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions, and the following disclaimer in the documentation
+ *    provided with the distribution.
+ *
+ * This software is provided "as is" and without any warranty, express or
+ * implied. In no event shall the authors be liable for any damages arising from
+ * the use of this software.
+ */
+
+#ifndef JLOGIN_CONFIG_H
+#define JLOGIN_CONFIG_H
+
+#include <stdbool.h>
+
+#define CONFIG_FILE "/etc/j-login.conf"
+
+typedef struct {
+   int spare_consoles;
+   int reap_delay;      /* seconds */
+   int lock_delay;      /* milliseconds */
+   int lock_retry;      /* seconds */
+   int grab_tries;
+   int grab_interval;   /* milliseconds */
+   int switch_timeout;  /* milliseconds */
+   int first_vt;
+   int first_display;
+   char * * x_args;     /* added to the X command line */
+   char * background;   /* NULL for none */
+   char * geometry;     /* of an Xvfb or Xephyr screen */
+   char * greeter_user; /* j-login-greeter runs as this user */
+   /* fixed at startup; a reload keeps the old values */
+   char * backend;      /* "vt", "xvfb", "xvnc" or "xephyr" */
+   char * runtime_dir;
+   char * state_dir;    /* kept across reboots */
+   char * pam_service;
+   char * pam_conf_dir; /* NULL for the system's */
+   bool headless;       /* a terminal server rather than a console */
+} config_t;
+
+/* replaced (not modified) on every reload, so do not keep pointers into it
+ * across a return to the main loop */
+extern const config_t * config;
+
+typedef void (* config_cb) (const config_t * old);
+
+void config_init (config_cb changed);
+void config_watch (void);
+void config_reload (void);
+char * runtime_path (const char * name); /* free with g_free */
+char * state_path (const char * name); /* free with g_free */
+
+#endif
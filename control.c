@@ -0,0 +1,220 @@
+/*
+ * J-Login - control.c
+ * Copyright 2019 John Lindgren
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions, and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions, and the following disclaimer in the documentation
+ *    provided with the distribution.
+ *
+ * This software is provided "as is" and without any warranty, express or
+ * implied. In no event shall the authors be liable for any damages arising from
+ * the use of this software.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pwd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <glib.h>
+#include <glib-unix.h>
+
+#include "actions.h"
+#include "config.h"
+#include "control.h"
+#include "utils.h"
+
+#define MAX_CLIENTS 16
+#define CLIENT_TIMEOUT 5 /* seconds to send the request, and to read the reply */
+
+typedef struct {
+   int handle;
+   uid_t uid;
+   char buf[256];
+   int length;
+   unsigned source, timeout_source;
+   char * out; /* the reply, once there is one */
+   int out_length, sent;
+} client_t;
+
+static int client_count;
+
+static void close_client (client_t * client) {
+   if (client->source)
+      g_source_remove (client->source);
+   if (client->timeout_source)
+      g_source_remove (client->timeout_source);
+   close (client->handle);
+   free (client->out);
+   free (client);
+   client_count --;
+}
+
+static int timeout_cb (void * data) {
+   client_t * client = data;
+   client->timeout_source = 0;
+   close_client (client);
+   return G_SOURCE_REMOVE;
+}
+
+static void arm_timeout (client_t * client) {
+   if (client->timeout_source)
+      g_source_remove (client->timeout_source);
+   client->timeout_source = g_timeout_add_seconds (CLIENT_TIMEOUT, timeout_cb,
+    client);
+}
+
+/* true while some of the reply is still to be sent */
+static bool send_more (client_t * client) {
+   while (client->sent < client->out_length) {
+      int sent = send (client->handle, client->out + client->sent,
+       client->out_length - client->sent, MSG_NOSIGNAL);
+      if (sent < 0 && errno == EINTR)
+         continue;
+      if (sent < 0)
+         return errno == EAGAIN;
+      client->sent += sent;
+   }
+   return false;
+}
+
+static int writable_cb (int handle, GIOCondition condition, void * data) {
+   (void) handle;
+   (void) condition;
+   client_t * client = data;
+   if (send_more (client))
+      return G_SOURCE_CONTINUE;
+   client->source = 0;
+   close_client (client);
+   return G_SOURCE_REMOVE;
+}
+
+/* a reply bigger than the socket buffer (metrics, or the status of a busy
+ * terminal server) goes out as the client reads it */
+static void reply (client_t * client, const char * text) {
+   client->out = my_strdup (text);
+   client->out_length = strlen (text);
+   if (! send_more (client)) {
+      close_client (client);
+      return;
+   }
+   client->source = g_unix_fd_add (client->handle, G_IO_OUT, writable_cb,
+    client);
+   arm_timeout (client);
+}
+
+static void locked_cb (bool locked, void * data) {
+   reply (data, locked ? "ok\n" : "failed\n");
+}
+
+static bool may_activate (uid_t uid, const char * user) {
+   if (! uid)
+      return true;
+   const struct passwd * p = getpwnam (user);
+   return p && p->pw_uid == uid;
+}
+
+static void handle_request (client_t * client, const char * request) {
+   if (! strcmp (request, "lock"))
+      lock_all (locked_cb, client);
+   else if (! strcmp (request, "status")) {
+      char * status = describe_sessions ();
+      reply (client, status);
+      g_free (status);
+   } else if (! strcmp (request, "metrics")) {
+      char * metrics = describe_metrics ();
+      reply (client, metrics);
+      g_free (metrics);
+   } else if (! strncmp (request, "activate ", 9)) {
+      const char * user = request + 9;
+      bool ok = may_activate (client->uid, user) && activate_session (user);
+      reply (client, ok ? "ok\n" : "failed\n");
+   } else
+      reply (client, "unknown request\n");
+}
+
+static int client_cb (int handle, GIOCondition condition, void * data) {
+   (void) condition;
+   client_t * client = data;
+   int got = read (handle, client->buf + client->length, sizeof client->buf -
+    1 - client->length);
+   if (got < 0 && (errno == EAGAIN || errno == EINTR))
+      return G_SOURCE_CONTINUE;
+   char * newline = NULL;
+   if (got > 0) {
+      client->length += got;
+      client->buf[client->length] = 0;
+      newline = strchr (client->buf, '\n');
+      if (! newline && client->length < (int) sizeof client->buf - 1)
+         return G_SOURCE_CONTINUE;
+   }
+   client->source = 0;
+   if (got <= 0)
+      close_client (client);
+   else if (newline) {
+      /* a lock takes as long as the greeters do, so it is not timed out */
+      g_source_remove (client->timeout_source);
+      client->timeout_source = 0;
+      * newline = 0;
+      handle_request (client, client->buf);
+   } else
+      reply (client, "request too long\n");
+   return G_SOURCE_REMOVE;
+}
+
+static int accept_cb (int listener, GIOCondition condition, void * unused) {
+   (void) condition;
+   (void) unused;
+   int handle = accept4 (listener, NULL, NULL, SOCK_CLOEXEC | SOCK_NONBLOCK);
+   if (handle < 0)
+      return G_SOURCE_CONTINUE;
+   if (client_count >= MAX_CLIENTS) {
+      close (handle);
+      return G_SOURCE_CONTINUE;
+   }
+   struct ucred cred;
+   socklen_t size = sizeof cred;
+   if (getsockopt (handle, SOL_SOCKET, SO_PEERCRED, & cred, & size) < 0) {
+      close (handle);
+      return G_SOURCE_CONTINUE;
+   }
+   NEW (client_t, client, handle, cred.uid, "", 0, 0, 0, NULL, 0, 0);
+   client_count ++;
+   client->source = g_unix_fd_add (handle, G_IO_IN | G_IO_HUP | G_IO_ERR,
+    client_cb, client);
+   arm_timeout (client);
+   return G_SOURCE_CONTINUE;
+}
+
+void control_init (void) {
+   int listener = socket (AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+   if (listener < 0)
+      fail ("socket");
+   char * path = runtime_path (CONTROL_NAME);
+   struct sockaddr_un addr = {.sun_family = AF_UNIX};
+   if (strlen (path) >= sizeof addr.sun_path)
+      error ("RuntimeDir is too long");
+   strcpy (addr.sun_path, path);
+   unlink (path);
+   if (bind (listener, (struct sockaddr *) & addr, sizeof addr) < 0)
+      fail2 ("bind", path);
+   /* anyone may lock; the rest is checked per request */
+   if (chmod (path, 0666) < 0)
+      fail2 ("chmod", path);
+   g_free (path);
+   if (listen (listener, 8) < 0)
+      fail ("listen");
+   g_unix_fd_add (listener, G_IO_IN, accept_cb, NULL);
+}
@@ -0,0 +1,34 @@
+/*
+ * J-Login - control.h
+ * Copyright 2019 John Lindgren
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions, and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions, and the following disclaimer in the documentation
+ *    provided with the distribution.
+ *
+ * This software is provided "as is" and without any warranty, express or
+ * implied. In no event shall the authors be liable for any damages arising from
+ * the use of this software.
+ */
+
+#ifndef JLOGIN_CONTROL_H
+#define JLOGIN_CONTROL_H
+
+/* Requests are single lines; the reply is sent and the connection closed:
+ *    lock           -> "ok" once every console is locked, else "failed"
+ *    status         -> one "vt display user" line per console ("-" if unused)
+ *    metrics        -> counters and histograms in Prometheus text format
+ *    activate USER  -> "ok" or "failed"; only root or USER may ask
+ * A client that is slow to send its request or read the reply is dropped. */
+
+#define CONTROL_NAME "j-login.sock" /* in RuntimeDir */
+
+void control_init (void);
+
+#endif
@@ -0,0 +1,510 @@
+/*
+ * J-Login - greeter.c
+ * Copyright 2019 John Lindgren
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions, and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions, and the following disclaimer in the documentation
+ *    provided with the distribution.
+ *
+ * This software is provided "as is" and without any warranty, express or
+ * implied. In no event shall the authors be liable for any damages arising from
+ * the use of this software.
+ */
+
+/* The greeter on each display is a separate j-login-greeter process running
+ * as GreeterUser, so that none of GTK runs as root and none of it stays in
+ * memory while it is not needed.  It is started when its display is to be
+ * shown and stopped when it is hidden; the daemon checks every request it
+ * makes before acting on it.  A greeter for a display whose X server is still
+ * starting gets on with loading GTK and its images in the meantime, and is
+ * told when the display is ready.
+ *
+ * A greeter holding its grabs keeps them if j-login goes away, since it may
+ * be all that covers a locked session.  A re-exec hands the sockets over to
+ * the new j-login, through the registry; after a crash, the new j-login stops
+ * the old greeter once its own is up and waiting for the grabs.
+ *
+ * A greeter that dies while shown is restarted, backing off if it keeps
+ * dying; until the new one is up, the daemon itself covers the display with
+ * a black window and holds the grabs, handing them over once the new greeter
+ * asks for them.
+ *
+ * The cost is on locking: a session's console has no greeter until it is
+ * locked, so a lock waits for a greeter to start (GTK initialization and a
+ * first paint) where a resident UI took a single frame. */
+
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <glib.h>
+#include <glib-unix.h>
+#include <X11/Xlib.h>
+
+#include "actions.h"
+#include "config.h"
+#include "greeter.h"
+#include "metrics.h"
+#include "registry.h"
+#include "trace.h"
+#include "utils.h"
+
+#define SHOW_TIMEOUT 10000 /* milliseconds, on top of the grab attempts */
+#define RESTART_DELAY 100 /* milliseconds, doubled up to MAX_RESTART_DELAY */
+#define MAX_RESTART_DELAY 5000
+
+/* outlives the greeter_t if the process is stopped before it is reaped */
+typedef struct {
+   greeter_t * greeter; /* NULL once the process is no longer wanted */
+} child_t;
+
+static int stopping; /* processes stopped but not yet reaped */
+
+/* the events a greeter may record (see ui.c); anything else it sends is
+ * dropped, so that an unprivileged process cannot grow the daemon's memory
+ * or put arbitrary text in the trace */
+static const char * const greeter_events[] = {"block_x", "ui_create",
+ "ui_build", "ui_realize", "ui_show", "ui_grabbed", "ui_not_grabbed"};
+
+struct greeter_s {
+   int display;
+   pid_t process, orphan; /* orphan is one left by a j-login that crashed */
+   unsigned long long process_start, orphan_start;
+   child_t * child;
+   int handle;
+   unsigned handle_source, timeout_source;
+   bool ready, showing, shown, checking, destroyed;
+   int64_t start;
+   char * status;
+   bool can_sleep, can_quit;
+   GList * waiters;
+   Display * xdisplay; /* NULL until ready */
+   Window cover; /* None unless covering for a greeter being restarted */
+   unsigned restart_source;
+   int restart_delay;
+   bool stale; /* started before a reload, and not yet told of it */
+};
+
+/* anything sent before the display is ready is sent again by greeter_ready */
+static void send_message (greeter_t * greeter, const message_t * msg) {
+   if (greeter->ready && greeter->handle >= 0)
+      send (greeter->handle, msg, sizeof (message_t), MSG_NOSIGNAL);
+}
+
+static void send_update (greeter_t * greeter) {
+   message_t msg = {.type = MSG_UPDATE, .can_sleep = greeter->can_sleep,
+    .can_quit = greeter->can_quit};
+   g_strlcpy (msg.text, greeter->status, sizeof msg.text);
+   send_message (greeter, & msg);
+}
+
+static void finish_show (greeter_t * greeter, bool shown) {
+   if (greeter->timeout_source) {
+      g_source_remove (greeter->timeout_source);
+      greeter->timeout_source = 0;
+   }
+   greeter->showing = false;
+   greeter->shown = shown;
+   finish_waiters (& greeter->waiters, shown);
+}
+
+static void disconnect (greeter_t * greeter) {
+   if (greeter->handle_source)
+      g_source_remove (greeter->handle_source);
+   close (greeter->handle);
+   greeter->child->greeter = NULL;
+   greeter->process = -1;
+   greeter->process_start = 0;
+   greeter->child = NULL;
+   greeter->handle = -1;
+   greeter->handle_source = 0;
+   greeter->shown = false;
+}
+
+static void cover (greeter_t * greeter) {
+   Display * display = greeter->xdisplay;
+   if (! display || greeter->cover)
+      return;
+   int screen = DefaultScreen (display);
+   XSetWindowAttributes attrs = {.background_pixel = BlackPixel (display,
+    screen), .override_redirect = True};
+   greeter->cover = XCreateWindow (display, RootWindow (display, screen), 0, 0,
+    DisplayWidth (display, screen), DisplayHeight (display, screen), 0,
+    CopyFromParent, InputOutput, CopyFromParent, CWBackPixel |
+    CWOverrideRedirect, & attrs);
+   XMapRaised (display, greeter->cover);
+   /* a session's own grab may be in the way; the window still hides it */
+   XGrabKeyboard (display, greeter->cover, True, GrabModeAsync, GrabModeAsync,
+    CurrentTime);
+   XGrabPointer (display, greeter->cover, True, 0, GrabModeAsync,
+    GrabModeAsync, greeter->cover, None, CurrentTime);
+   XFlush (display);
+}
+
+/* the window stays up until the greeter has its own */
+static void release_cover_grabs (greeter_t * greeter) {
+   if (! greeter->cover)
+      return;
+   XUngrabKeyboard (greeter->xdisplay, CurrentTime);
+   XUngrabPointer (greeter->xdisplay, CurrentTime);
+   XFlush (greeter->xdisplay);
+}
+
+static void uncover (greeter_t * greeter) {
+   if (! greeter->cover)
+      return;
+   XDestroyWindow (greeter->xdisplay, greeter->cover);
+   XFlush (greeter->xdisplay);
+   greeter->cover = None;
+}
+
+/* a greeter holding its grabs ignores the socket closing, so it takes SIGTERM
+ * (which also gets one that hangs) */
+static void stop (greeter_t * greeter) {
+   if (greeter->process < 0)
+      return;
+   kill (greeter->process, SIGTERM);
+   stopping ++;
+   disconnect (greeter);
+}
+
+static int timeout_cb (void * data) {
+   greeter_t * greeter = data;
+   greeter->timeout_source = 0;
+   warning ("greeter did not respond");
+   stop (greeter);
+   finish_show (greeter, false);
+   return G_SOURCE_REMOVE;
+}
+
+static void send_show (greeter_t * greeter) {
+   greeter->start = metrics_now ();
+   message_t msg = {.type = MSG_SHOW};
+   send_message (greeter, & msg);
+   greeter->timeout_source = g_timeout_add (SHOW_TIMEOUT + config->grab_tries *
+    config->grab_interval, timeout_cb, greeter);
+}
+
+/* only once our own greeter needs the grabs, so that the display is never
+ * left uncovered */
+static void stop_orphan (greeter_t * greeter) {
+   if (greeter->orphan > 0 && registry_start_time (greeter->orphan) ==
+    greeter->orphan_start)
+      kill (greeter->orphan, SIGTERM);
+   greeter->orphan = -1;
+}
+
+static void login_done (bool success, void * data) {
+   greeter_t * greeter = data;
+   greeter->checking = false;
+   if (greeter->destroyed) {
+      free (greeter);
+      return;
+   }
+   message_t msg = {.type = MSG_LOGIN_DONE, .ok = success};
+   send_message (greeter, & msg);
+}
+
+static void attempt_login (greeter_t * greeter, message_t * msg) {
+   msg->text[sizeof msg->text - 1] = 0;
+   const char * name = msg->text;
+   int length = strlen (name);
+   const char * password = (length + 1 < (int) sizeof msg->text) ? name +
+    length + 1 : "";
+   if (greeter->checking)
+      return;
+   /* e.g. one made while a re-exec was handing the greeter over */
+   if (! greeter->shown) {
+      login_done (false, greeter);
+      return;
+   }
+   greeter->checking = true;
+   log_in (name, password, login_done, greeter);
+}
+
+static void shown_cb (greeter_t * greeter, bool shown) {
+   if (! greeter->showing)
+      return;
+   trace_mark (shown ? "greeter_shown" : "greeter_not_shown");
+   if (shown) {
+      metrics_observe (HIST_GREETER_START, greeter->start);
+      stop_orphan (greeter);
+      uncover (greeter);
+      greeter->restart_delay = RESTART_DELAY;
+   } else {
+      metrics_count (COUNT_GRAB_FAILURES);
+      stop (greeter);
+   }
+   finish_show (greeter, shown);
+}
+
+static void insert_trace (greeter_t * greeter, const message_t * msg) {
+   if (msg->phase != 'B' && msg->phase != 'E' && msg->phase != 'i')
+      return;
+   for (unsigned i = 0; i < G_N_ELEMENTS (greeter_events); i ++) {
+      if (! strncmp (msg->text, greeter_events[i], sizeof msg->text)) {
+         trace_insert (greeter_events[i], msg->phase, greeter->process,
+          greeter->process, msg->usec);
+         return;
+      }
+   }
+}
+
+/* a broken connection is left for exited_cb */
+static int handle_cb (int handle, GIOCondition condition, void * data) {
+   (void) condition;
+   greeter_t * greeter = data;
+   message_t msg;
+   if (recv (handle, & msg, sizeof msg, 0) != sizeof msg) {
+      greeter->handle_source = 0;
+      return G_SOURCE_REMOVE;
+   }
+   switch (msg.type) {
+   case MSG_SHOWN:
+      shown_cb (greeter, msg.ok);
+      break;
+   case MSG_LOG_IN:
+      attempt_login (greeter, & msg);
+      memset (& msg, 0, sizeof msg);
+      break;
+   case MSG_SLEEP:
+      if (greeter->can_sleep)
+         do_sleep ();
+      break;
+   case MSG_SHUT_DOWN:
+      if (greeter->can_quit)
+         queue_shutdown ();
+      break;
+   case MSG_REBOOT:
+      if (greeter->can_quit)
+         queue_reboot ();
+      break;
+   case MSG_BLOCKED:
+      stop_orphan (greeter);
+      release_cover_grabs (greeter);
+      break;
+   case MSG_TRACE:
+      insert_trace (greeter, & msg);
+      break;
+   }
+   return G_SOURCE_CONTINUE;
+}
+
+static bool start (greeter_t * greeter);
+static void send_show (greeter_t * greeter);
+
+static void start_show (greeter_t * greeter) {
+   if (greeter->process < 0 && ! start (greeter))
+      finish_show (greeter, false);
+   else if (greeter->ready)
+      send_show (greeter);
+}
+
+static int restart_cb (void * data) {
+   greeter_t * greeter = data;
+   greeter->restart_source = 0;
+   start_show (greeter);
+   return G_SOURCE_REMOVE;
+}
+
+/* a greeter that dies while shown (leaving a session unlocked) is replaced,
+ * under cover; one that dies before it is shown just fails the show */
+static void exited_cb (pid_t process, void * data) {
+   (void) process;
+   child_t * child = data;
+   greeter_t * greeter = child->greeter;
+   free (child);
+   if (! greeter) {
+      stopping --;
+      return;
+   }
+   warning ("greeter exited unexpectedly");
+   bool shown = greeter->shown;
+   disconnect (greeter);
+   if (greeter->showing)
+      finish_show (greeter, false);
+   else if (shown) {
+      cover (greeter);
+      greeter->showing = true;
+      greeter->restart_source = g_timeout_add (greeter->restart_delay,
+       restart_cb, greeter);
+      greeter->restart_delay = MIN (greeter->restart_delay * 2,
+       MAX_RESTART_DELAY);
+   }
+}
+
+/* one whose display is not ready yet is told once it is */
+static void send_reload (greeter_t * greeter) {
+   if (! greeter->stale || ! greeter->ready)
+      return;
+   message_t msg = {.type = MSG_RELOAD};
+   send_message (greeter, & msg);
+   greeter->stale = false;
+}
+
+static void send_ready (greeter_t * greeter) {
+   message_t msg = {.type = MSG_READY};
+   send_message (greeter, & msg);
+   send_update (greeter);
+   send_reload (greeter);
+}
+
+static void attach (greeter_t * greeter, pid_t process, int handle) {
+   greeter->process = process;
+   greeter->process_start = registry_start_time (process);
+   greeter->stale = false;
+   greeter->handle = handle;
+   greeter->handle_source = g_unix_fd_add (handle, G_IO_IN, handle_cb, greeter);
+   NEW (child_t, child, greeter);
+   greeter->child = child;
+   watch_exit (process, exited_cb, child);
+}
+
+/* the first messages are queued before the greeter even starts reading */
+static bool start (greeter_t * greeter) {
+   trace_mark ("greeter_start");
+   int fds[2];
+   if (socketpair (AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, fds) < 0)
+      fail ("socketpair");
+   if (fcntl (fds[1], F_SETFD, 0) < 0)
+      fail2 ("fcntl", "greeter socket");
+   SPRINTF (handle_str, "%d", fds[1]);
+   const char * const args[] = {"j-login-greeter", handle_str, NULL};
+   pid_t process = launch_set_display (args, greeter->display);
+   close (fds[1]);
+   if (process < 0) {
+      close (fds[0]);
+      return false;
+   }
+   attach (greeter, process, fds[0]);
+   send_ready (greeter);
+   return true;
+}
+
+greeter_t * greeter_new (int display) {
+   NEW (greeter_t, greeter, display, -1, -1, 0, 0, NULL, -1, 0, 0, false, false,
+    false, false, false, 0, my_strdup (""), false, false, NULL, NULL, None, 0,
+    RESTART_DELAY, false);
+   return greeter;
+}
+
+/* takes over the greeter recorded for the display by an earlier j-login.  One
+ * that this process started before a re-exec is still our child and still
+ * connected through handle; it is asked to show again like any other.  One
+ * left by a crash is stopped once it is in the way. */
+void greeter_adopt (greeter_t * greeter, pid_t process,
+ unsigned long long start, int handle) {
+   siginfo_t info;
+   if (handle >= 0 && ! waitid (P_PID, process, & info, WEXITED | WNOHANG |
+    WNOWAIT) && ! fcntl (handle, F_SETFD, FD_CLOEXEC)) {
+      attach (greeter, process, handle);
+      /* the configuration may have changed across the re-exec */
+      greeter->stale = true;
+      return;
+   }
+   greeter->orphan = process;
+   greeter->orphan_start = start;
+}
+
+/* for a re-exec: the socket is kept open across it; -1 if there is none */
+int greeter_hand_over (greeter_t * greeter) {
+   if (greeter->handle < 0 || fcntl (greeter->handle, F_SETFD, 0) < 0)
+      return -1;
+   return greeter->handle;
+}
+
+void greeter_ready (greeter_t * greeter, Display * display) {
+   greeter->ready = true;
+   greeter->xdisplay = display;
+   send_ready (greeter);
+   if (greeter->showing)
+      send_show (greeter);
+}
+
+/* callback may be NULL; it may also be called before greeter_show returns */
+void greeter_show (greeter_t * greeter, greeter_cb callback, void * data) {
+   if (greeter->shown) {
+      if (callback)
+         callback (true, data);
+      return;
+   }
+   add_waiter (& greeter->waiters, callback, data);
+   if (greeter->showing)
+      return;
+   greeter->showing = true;
+   start_show (greeter);
+}
+
+void greeter_hide (greeter_t * greeter) {
+   if (greeter->restart_source) {
+      g_source_remove (greeter->restart_source);
+      greeter->restart_source = 0;
+   }
+   uncover (greeter);
+   stop (greeter);
+   if (greeter->showing)
+      finish_show (greeter, false);
+}
+
+bool greeter_any_stopping (void) {
+   return stopping > 0;
+}
+
+bool greeter_busy (greeter_t * greeter) {
+   return greeter->showing || greeter->checking;
+}
+
+bool greeter_shown (greeter_t * greeter) {
+   return greeter->shown;
+}
+
+pid_t greeter_process (greeter_t * greeter) {
+   return greeter->process;
+}
+
+unsigned long long greeter_start_time (greeter_t * greeter) {
+   return greeter->process_start;
+}
+
+/* sent only on a change, since every console's greeter gets every update */
+void greeter_update (greeter_t * greeter, const char * status, bool can_sleep,
+ bool can_quit) {
+   if (! strcmp (greeter->status, status) && can_sleep == greeter->can_sleep &&
+    can_quit == greeter->can_quit)
+      return;
+   free (greeter->status);
+   greeter->status = my_strdup (status);
+   greeter->can_sleep = can_sleep;
+   greeter->can_quit = can_quit;
+   send_update (greeter);
+}
+
+/* a greeter not running reads the new configuration when it starts */
+void greeter_reload (greeter_t * greeter) {
+   if (greeter->process < 0)
+      return;
+   greeter->stale = true;
+   send_reload (greeter);
+}
+
+/* one still checking a login is freed once the answer comes */
+void greeter_destroy (greeter_t * greeter) {
+   greeter_hide (greeter);
+   stop_orphan (greeter);
+   free (greeter->status);
+   if (greeter->checking)
+      greeter->destroyed = true;
+   else
+      free (greeter);
+}
@@ -0,0 +1,78 @@
+/*
+ * J-Login - greeter.h
+ * Copyright 2019 John Lindgren
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions, and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions, and the following disclaimer in the documentation
+ *    provided with the distribution.
+ *
+ * This software is provided "as is" and without any warranty, express or
+ * implied. In no event shall the authors be liable for any damages arising from
+ * the use of this software.
+ */
+
+#ifndef JLOGIN_GREETER_H
+#define JLOGIN_GREETER_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include <X11/Xlib.h>
+
+/* Messages between j-login and j-login-greeter, one per packet on a
+ * SOCK_SEQPACKET socket */
+
+typedef enum {
+   /* to the greeter */
+   MSG_READY,      /* the display accepts connections; always sent first */
+   MSG_UPDATE,     /* text is the status; can_sleep and can_quit */
+   MSG_SHOW,
+   MSG_LOGIN_DONE, /* ok if the login succeeded */
+   /* from the greeter */
+   MSG_SHOWN,      /* ok if the grabs are held */
+   MSG_LOG_IN,     /* text is the name and the password, each nul-terminated */
+   MSG_SLEEP,
+   MSG_SHUT_DOWN,
+   MSG_REBOOT,
+   MSG_TRACE,      /* text is the name of a trace event; phase and usec */
+   MSG_BLOCKED,    /* the windows are up but another client holds a grab */
+   /* to the greeter, added later */
+   MSG_RELOAD      /* the configuration file has changed */
+} msg_type_t;
+
+typedef struct {
+   int type;
+   bool ok, can_sleep, can_quit;
+   char phase;
+   int64_t usec;
+   char text[4096];
+} message_t;
+
+typedef struct greeter_s greeter_t;
+typedef void (* greeter_cb) (bool shown, void * data);
+
+greeter_t * greeter_new (int display);
+void greeter_adopt (greeter_t * greeter, pid_t process,
+ unsigned long long start, int handle);
+int greeter_hand_over (greeter_t * greeter);
+void greeter_ready (greeter_t * greeter, Display * display);
+void greeter_show (greeter_t * greeter, greeter_cb callback, void * data);
+void greeter_hide (greeter_t * greeter);
+bool greeter_busy (greeter_t * greeter);
+bool greeter_any_stopping (void);
+bool greeter_shown (greeter_t * greeter);
+pid_t greeter_process (greeter_t * greeter); /* -1 if not running */
+unsigned long long greeter_start_time (greeter_t * greeter);
+void greeter_update (greeter_t * greeter, const char * status, bool can_sleep,
+ bool can_quit);
+void greeter_reload (greeter_t * greeter);
+void greeter_destroy (greeter_t * greeter);
+
+#endif
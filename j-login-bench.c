@@ -0,0 +1,378 @@
+/*
+ * J-Login - j-login-bench.c
+ * Copyright 2019 John Lindgren
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions, and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions, and the following disclaimer in the documentation
+ *    provided with the distribution.
+ *
+ * This software is provided "as is" and without any warranty, express or
+ * implied. In no event shall the authors be liable for any damages arising from
+ * the use of this software.
+ */
+
+/* End-to-end timing of the login path, run by "make bench" as an ordinary
+ * user.  j-login is started from the build directory on Xvfb displays, out of
+ * a private directory holding its configuration, a stub PAM service that
+ * accepts any password and a stub session; the greeter is then driven through
+ * XTest, as if at the keyboard.  Each step is timed from outside: a greeter
+ * counts as visible once it has the input focus, and a login as authenticated
+ * once the greeter has handed the focus back.
+ *
+ * The first part starts j-login afresh for every run and reports percentiles
+ * over the runs; the second keeps one headless j-login, adds consoles one at
+ * a time and logs in on each, and then locks them all, to show how the work
+ * grows with the number of consoles. */
+
+#include <errno.h>
+#include <pwd.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <glib.h>
+#include <X11/Xlib.h>
+#include <X11/XKBlib.h>
+#include <X11/keysym.h>
+#include <X11/extensions/XTest.h>
+
+#include "config.h"
+#include "registry.h"
+#include "utils.h"
+
+#define FIRST_DISPLAY 70 /* well clear of any real X server */
+#define PASSWORD "bench" /* anything will do for the stub service */
+#define TIMEOUT 20000000 /* microseconds; a refill alone takes five seconds */
+
+typedef enum {
+   GREETER_VISIBLE, /* from starting j-login */
+   AUTH_COMPLETE,   /* from pressing Enter on the password */
+   SESSION_EXEC,    /* likewise, until the stub session runs */
+   LOCK_VISIBLE,    /* from SIGUSR1 */
+   N_STATS
+} stat_t;
+
+static const char * const stat_names[N_STATS] = {"greeter-visible",
+ "auth-complete", "session-exec", "lock-visible"};
+
+static char * root;
+static const char * user;
+static pid_t daemon_process = -1;
+static GArray * samples[N_STATS]; /* microseconds */
+
+static void write_file (const char * name, const char * contents, int mode) {
+   char * path = g_build_filename (root, name, NULL);
+   if (! g_file_set_contents (path, contents, -1, NULL) || chmod (path, mode) < 0)
+      fail2 ("write", path);
+   g_free (path);
+}
+
+static void make_dir (const char * name) {
+   char * path = g_build_filename (root, name, NULL);
+   if (mkdir (path, 0700) < 0)
+      fail2 ("mkdir", path);
+   g_free (path);
+}
+
+/* bin comes first in PATH, so that the stubs are run instead of the real
+ * j-session and j-login-setup; the binaries under test come next */
+static void set_up_root (void) {
+   if (! (root = g_dir_make_tmp ("j-login-bench-XXXXXX", NULL)))
+      fail ("g_dir_make_tmp");
+   make_dir ("bin");
+   make_dir ("pam.d");
+   make_dir ("run");
+   make_dir ("state");
+   write_file ("bin/j-session", "#!/bin/sh\n"
+    ": > \"$J_LOGIN_BENCH/session-$DISPLAY\"\nexec sleep 86400\n", 0755);
+   write_file ("bin/j-login-setup", "#!/bin/sh\n", 0755);
+   write_file ("pam.d/j-login-bench", "auth required pam_permit.so\n"
+    "account required pam_permit.so\npassword required pam_permit.so\n"
+    "session required pam_permit.so\n", 0644);
+   char * config_path = g_build_filename (root, "j-login.conf", NULL);
+   char * dir = g_get_current_dir ();
+   char * path = g_strdup_printf ("%s/bin:%s:%s", root, dir, g_getenv ("PATH"));
+   my_setenv ("J_LOGIN_CONFIG", config_path);
+   my_setenv ("J_LOGIN_BENCH", root);
+   my_setenv ("PATH", path);
+   g_free (config_path);
+   g_free (dir);
+   g_free (path);
+}
+
+static void write_config (int spare_consoles, bool headless) {
+   char * contents = g_strdup_printf ("[J-Login]\nBackend=xvfb\n"
+    "RuntimeDir=%s/run\nStateDir=%s/state\nPamService=j-login-bench\n"
+    "PamConfDir=%s/pam.d\nFirstDisplay=%d\nSpareConsoles=%d\nReapDelay=3600\n"
+    "LockDelay=86400000\nHeadless=%s\n", root, root, root, FIRST_DISPLAY,
+    spare_consoles, headless ? "true" : "false");
+   write_file ("j-login.conf", contents, 0644);
+   g_free (contents);
+}
+
+/* in a process group of its own, so that the X servers, greeters and
+ * sessions it leaves behind (see KillMode in j-login.service) go with it */
+static void start_daemon (void) {
+   daemon_process = fork ();
+   if (! daemon_process) {
+      setpgid (0, 0);
+      static const char * const args[] = {"j-login", NULL};
+      execvp (args[0], (char * const *) args);
+      /* not exit (), which would run clean_up in the child */
+      fprintf (stderr, "%s: execvp failed for %s: %s.\n", NAME, args[0],
+       strerror (errno));
+      _exit (127);
+   } else if (daemon_process < 0)
+      fail ("fork");
+   setpgid (daemon_process, daemon_process);
+}
+
+/* also on error (), so that nothing is left running */
+static void clean_up (void) {
+   if (daemon_process > 0)
+      kill (- daemon_process, SIGKILL);
+   const char * const args[] = {"rm", "-rf", root, NULL};
+   pid_t process = launch (args);
+   if (process > 0)
+      wait_for_exit (process);
+}
+
+static void stop_daemon (void) {
+   kill (- daemon_process, SIGTERM);
+   wait_for_exit (daemon_process);
+   int64_t deadline = g_get_monotonic_time () + TIMEOUT;
+   while (! kill (- daemon_process, 0) || errno != ESRCH) {
+      if (g_get_monotonic_time () > deadline)
+         kill (- daemon_process, SIGKILL);
+      g_usleep (10000);
+   }
+   daemon_process = -1;
+   char * registry = runtime_path (REGISTRY_FILE);
+   unlink (registry);
+   g_free (registry);
+}
+
+typedef bool (* check_fn) (void * data);
+
+/* polls every millisecond, which is as fine as the figures are worth */
+static int64_t wait_for (check_fn check, void * data, const char * what) {
+   int64_t deadline = g_get_monotonic_time () + TIMEOUT;
+   while (! check (data)) {
+      if (waitpid (daemon_process, NULL, WNOHANG) == daemon_process)
+         error ("j-login exited");
+      if (g_get_monotonic_time () > deadline) {
+         SPRINTF (message, "timed out waiting for %s", what);
+         error (message);
+      }
+      g_usleep (1000);
+   }
+   return g_get_monotonic_time ();
+}
+
+typedef struct {
+   int index;
+   record_t record;
+   Display * display;
+} console_t;
+
+static bool listed (void * data) {
+   console_t * console = data;
+   int count;
+   record_t * records = registry_load (& count);
+   if (count > console->index)
+      console->record = records[console->index];
+   free (records);
+   return count > console->index;
+}
+
+static bool connected (void * data) {
+   console_t * console = data;
+   SPRINTF (disp_name, ":%d", console->record.display);
+   return (console->display = XOpenDisplay (disp_name)) != NULL;
+}
+
+/* the X server is listed as soon as it is launched, before it is ready */
+static Display * open_console (int index, int64_t * when) {
+   console_t console = {.index = index};
+   * when = wait_for (listed, & console, "a console");
+   wait_for (connected, & console, "the display");
+   return console.display;
+}
+
+static bool focused (void * data) {
+   Display * display = data;
+   Window focus;
+   int revert;
+   XGetInputFocus (display, & focus, & revert);
+   return focus != None && focus != PointerRoot && focus != DefaultRootWindow
+    (display);
+}
+
+static bool unfocused (void * data) {
+   return ! focused (data);
+}
+
+static int64_t wait_for_greeter (Display * display) {
+   return wait_for (focused, display, "the greeter");
+}
+
+static int64_t wait_for_hidden (Display * display) {
+   return wait_for (unfocused, display, "the greeter to hide");
+}
+
+static char * session_path (Display * display) {
+   char * name = g_strdup_printf ("session-%s", DisplayString (display));
+   char * path = g_build_filename (root, name, NULL);
+   g_free (name);
+   return path;
+}
+
+static bool session_started (void * data) {
+   return ! access (data, F_OK);
+}
+
+static int64_t wait_for_session (Display * display) {
+   char * path = session_path (display);
+   int64_t when = wait_for (session_started, path, "the session");
+   unlink (path);
+   g_free (path);
+   return when;
+}
+
+/* printable ASCII has the same codes as keysyms */
+static void press_key (Display * display, KeySym sym) {
+   KeyCode code = XKeysymToKeycode (display, sym);
+   KeyCode shift = XKeysymToKeycode (display, XK_Shift_L);
+   if (! code) {
+      SPRINTF (message, "cannot type %s", XKeysymToString (sym));
+      error (message);
+   }
+   bool shifted = (XkbKeycodeToKeysym (display, code, 0, 0) != sym);
+   if (shifted)
+      XTestFakeKeyEvent (display, shift, true, CurrentTime);
+   XTestFakeKeyEvent (display, code, true, CurrentTime);
+   XTestFakeKeyEvent (display, code, false, CurrentTime);
+   if (shifted)
+      XTestFakeKeyEvent (display, shift, false, CurrentTime);
+}
+
+/* returns when the last key has reached the X server */
+static int64_t type_line (Display * display, const char * text) {
+   for (const char * c = text; * c; c ++)
+      press_key (display, (unsigned char) * c);
+   press_key (display, XK_Return);
+   XSync (display, false);
+   return g_get_monotonic_time ();
+}
+
+/* Enter on the name moves to the password, and Enter there logs in */
+static int64_t log_in (Display * display) {
+   type_line (display, user);
+   return type_line (display, PASSWORD);
+}
+
+static void add_sample (stat_t stat, int64_t usec) {
+   g_array_append_val (samples[stat], usec);
+}
+
+static void run_once (void) {
+   int64_t start = g_get_monotonic_time (), listed_at;
+   start_daemon ();
+   Display * display = open_console (0, & listed_at);
+   add_sample (GREETER_VISIBLE, wait_for_greeter (display) - start);
+   int64_t enter = log_in (display);
+   add_sample (AUTH_COMPLETE, wait_for_hidden (display) - enter);
+   add_sample (SESSION_EXEC, wait_for_session (display) - enter);
+   int64_t lock = g_get_monotonic_time ();
+   kill (daemon_process, SIGUSR1);
+   add_sample (LOCK_VISIBLE, wait_for_greeter (display) - lock);
+   log_in (display);
+   wait_for_hidden (display);
+   XCloseDisplay (display);
+   stop_daemon ();
+}
+
+static int compare_samples (const void * a, const void * b) {
+   int64_t sa = * (const int64_t *) a, sb = * (const int64_t *) b;
+   return sa < sb ? -1 : sa > sb;
+}
+
+/* nearest rank, in milliseconds */
+static double percentile (GArray * array, int percent) {
+   int rank = (array->len * percent + 99) / 100;
+   return g_array_index (array, int64_t, MAX (rank, 1) - 1) / 1000.0;
+}
+
+static void report (int runs) {
+   printf ("%d runs, one console:\n%-16s %10s %10s\n", runs, "", "p50 (ms)",
+    "p99 (ms)");
+   for (int i = 0; i < N_STATS; i ++) {
+      g_array_sort (samples[i], compare_samples);
+      printf ("%-16s %10.1f %10.1f\n", stat_names[i], percentile (samples[i],
+       50), percentile (samples[i], 99));
+   }
+}
+
+/* each login leaves no unused console, so j-login opens the next one as a
+ * spare; the greeter is timed from when the console is listed, which leaves
+ * out the five seconds a refill waits before starting */
+static void run_scaling (int count) {
+   Display * displays[count];
+   write_config (count, true);
+   start_daemon ();
+   printf ("\n%-8s %20s %20s\n", "consoles", "greeter-visible (ms)",
+    "auth-complete (ms)");
+   for (int i = 0; i < count; i ++) {
+      int64_t listed_at;
+      displays[i] = open_console (i, & listed_at);
+      int64_t visible = wait_for_greeter (displays[i]);
+      int64_t enter = log_in (displays[i]);
+      int64_t done = wait_for_hidden (displays[i]);
+      wait_for_session (displays[i]);
+      printf ("%-8d %20.1f %20.1f\n", i + 1, (visible - listed_at) / 1000.0,
+       (done - enter) / 1000.0);
+   }
+   int64_t lock = g_get_monotonic_time ();
+   kill (daemon_process, SIGUSR1);
+   int64_t visible = lock;
+   for (int i = 0; i < count; i ++)
+      visible = MAX (visible, wait_for_greeter (displays[i]));
+   printf ("lock-visible on all %d consoles: %.1f ms\n", count, (visible -
+    lock) / 1000.0);
+   for (int i = 0; i < count; i ++)
+      XCloseDisplay (displays[i]);
+   stop_daemon ();
+}
+
+int main (int argc, char * * argv) {
+   int runs = (argc > 1) ? atoi (argv[1]) : 20;
+   int consoles = (argc > 2) ? atoi (argv[2]) : 4;
+   if (argc > 3 || runs < 1 || consoles < 1)
+      error ("usage: j-login-bench [runs [consoles]]");
+   /* j-login refuses logins as root, and the stub service accepts anyone */
+   const struct passwd * p = getpwuid (getuid ());
+   if (! getuid () || ! p)
+      error ("run j-login-bench as an ordinary user");
+   user = p->pw_name;
+   set_up_root ();
+   atexit (clean_up);
+   write_config (0, false);
+   config_init (NULL);
+   for (int i = 0; i < N_STATS; i ++)
+      samples[i] = g_array_new (false, false, sizeof (int64_t));
+   for (int i = 0; i < runs; i ++)
+      run_once ();
+   report (runs);
+   run_scaling (consoles);
+   return 0;
+}
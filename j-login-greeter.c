@@ -0,0 +1,183 @@
+/*
+ * J-Login - j-login-greeter.c
+ * Copyright 2019 John Lindgren
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions, and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions, and the following disclaimer in the documentation
+ *    provided with the distribution.
+ *
+ * This software is provided "as is" and without any warranty, express or
+ * implied. In no event shall the authors be liable for any damages arising from
+ * the use of this software.
+ */
+
+/* The login UI for one display, started by j-login with the display in
+ * $DISPLAY and its end of a socket as the only argument.  It drops to
+ * GreeterUser before touching GTK and exits when j-login closes the socket,
+ * unless it holds its grabs: those it keeps, since it may be all that covers
+ * a locked session, until it is sent SIGTERM.
+ * It may be started before X is ready, so it does all it can without the
+ * display (loading GTK, decoding images) before waiting to be told. */
+
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <glib-unix.h>
+#include <gtk/gtk.h>
+
+#include "actions.h"
+#include "config.h"
+#include "greeter.h"
+#include "trace.h"
+#include "ui.h"
+#include "utils.h"
+
+static int handle;
+static ui_t * ui;
+static log_in_cb login_callback;
+static void * login_data;
+
+static bool grabbed, disconnected;
+
+/* fails once j-login has gone */
+static bool send_message (message_t * msg) {
+   return ! disconnected && send (handle, msg, sizeof (message_t),
+    MSG_NOSIGNAL) == sizeof (message_t);
+}
+
+static void send_type (int type) {
+   message_t msg = {.type = type};
+   send_message (& msg);
+}
+
+/* called only by ui.c, so the login is always on our one ui */
+void log_in (const char * name, const char * password, log_in_cb callback,
+ void * data) {
+   message_t msg = {.type = MSG_LOG_IN};
+   int name_size = strlen (name) + 1;
+   if (name_size + (int) strlen (password) + 1 > (int) sizeof msg.text) {
+      callback (false, data);
+      return;
+   }
+   memcpy (msg.text, name, name_size);
+   strcpy (msg.text + name_size, password);
+   bool sent = send_message (& msg);
+   memset (& msg, 0, sizeof msg);
+   if (! sent) {
+      callback (false, data);
+      return;
+   }
+   login_callback = callback;
+   login_data = data;
+}
+
+void do_sleep (void) {
+   send_type (MSG_SLEEP);
+}
+
+void queue_shutdown (void) {
+   send_type (MSG_SHUT_DOWN);
+}
+
+void queue_reboot (void) {
+   send_type (MSG_REBOOT);
+}
+
+static void forward_cb (const char * name, char phase, int64_t usec) {
+   message_t msg = {.type = MSG_TRACE, .phase = phase, .usec = usec};
+   g_strlcpy (msg.text, name, sizeof msg.text);
+   send_message (& msg);
+}
+
+void grab_blocked (void) {
+   send_type (MSG_BLOCKED);
+}
+
+static void shown_cb (bool shown, void * unused) {
+   (void) unused;
+   grabbed = shown;
+   message_t msg = {.type = MSG_SHOWN, .ok = shown};
+   send_message (& msg);
+}
+
+static void finish_login (bool success) {
+   if (login_callback) {
+      log_in_cb callback = login_callback;
+      login_callback = NULL;
+      callback (success, login_data);
+   }
+}
+
+static int handle_cb (int fd, GIOCondition condition, void * unused) {
+   (void) condition;
+   (void) unused;
+   message_t msg;
+   if (recv (fd, & msg, sizeof msg, 0) != sizeof msg) {
+      if (! grabbed)
+         exit (0);
+      disconnected = true;
+      finish_login (false);
+      return G_SOURCE_REMOVE;
+   }
+   switch (msg.type) {
+   case MSG_UPDATE:
+      msg.text[sizeof msg.text - 1] = 0;
+      ui_update (ui, msg.text, msg.can_sleep, msg.can_quit);
+      break;
+   case MSG_SHOW:
+      ui_show (ui, shown_cb, NULL);
+      break;
+   case MSG_LOGIN_DONE:
+      finish_login (msg.ok);
+      break;
+   case MSG_RELOAD:
+      config_reload ();
+      break;
+   }
+   return G_SOURCE_CONTINUE;
+}
+
+static void wait_for_display (void) {
+   message_t msg;
+   if (recv (handle, & msg, sizeof msg, 0) != sizeof msg || msg.type !=
+    MSG_READY)
+      exit (0);
+}
+
+static void config_changed (const config_t * old) {
+   if (g_strcmp0 (config->background, old->background)) {
+      ui_set_background (config->background);
+      ui_redraw_background (ui);
+   }
+}
+
+int main (int argc, char * * argv) {
+   if (argc != 2)
+      error ("usage: j-login-greeter <socket>");
+   handle = atoi (argv[1]);
+   if (fcntl (handle, F_SETFD, FD_CLOEXEC) < 0)
+      fail2 ("FD_CLOEXEC", "socket");
+   trace_forward (forward_cb);
+   config_init (config_changed);
+   drop_privileges (config->greeter_user);
+   if (! gtk_parse_args (NULL, NULL))
+      fail ("gtk_parse_args");
+   ui_preload ();
+   if (config->background)
+      ui_set_background (config->background);
+   wait_for_display ();
+   gtk_init (NULL, NULL);
+   ui = ui_create (gdk_display_get_default (), "", false, false);
+   g_unix_fd_add (handle, G_IO_IN, handle_cb, NULL);
+   gtk_main ();
+   return 0;
+}
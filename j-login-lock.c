@@ -17,12 +17,33 @@
  * the use of this software.
  */
 
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 #include <unistd.h>
 
+#include <glib.h>
+
+#include "config.h"
+#include "control.h"
+
+/* returns once j-login has locked every console; the socket is found from
+ * the same configuration as j-login's, so RuntimeDir is honoured */
 int main (void) {
-   /* we are setuid, so use the full path */
-   static const char * const args[] = {"/usr/bin/pkill", "-USR1", "j-login", NULL};
-   execv (args[0], (char * const *) args);
-   /* if we get here, return an error */
-   return 1;
+   config_init (NULL);
+   char * path = runtime_path (CONTROL_NAME);
+   struct sockaddr_un addr = {.sun_family = AF_UNIX};
+   if (strlen (path) >= sizeof addr.sun_path)
+      return 1;
+   strcpy (addr.sun_path, path);
+   g_free (path);
+   int handle = socket (AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+   if (handle < 0 || connect (handle, (struct sockaddr *) & addr, sizeof addr) < 0)
+      return 1;
+   static const char request[] = "lock\n";
+   if (write (handle, request, sizeof request - 1) != sizeof request - 1)
+      return 1;
+   char buf[16];
+   int got = read (handle, buf, sizeof buf);
+   return (got == 3 && ! memcmp (buf, "ok\n", 3)) ? 0 : 1;
 }
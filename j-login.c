@@ -17,224 +17,827 @@
  * the use of this software.
  */
 
-#include <pthread.h>
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
 
-#include <gdk/gdkx.h>
-#include <gtk/gtk.h>
+#include <glib.h>
+#include <glib-unix.h>
+#include <X11/Xlib.h>
 
 #include "actions.h"
+#include "config.h"
+#include "control.h"
+#include "greeter.h"
+#include "logind.h"
+#include "metrics.h"
+#include "registry.h"
 #include "screen.h"
-#include "ui.h"
+#include "trace.h"
 #include "utils.h"
+#include "zygote.h"
 
 typedef struct {
    int vt, disp_num;
-   GdkDisplay * display;
-   ui_t * ui;
+   pid_t x_process;
+   Display * display; /* only for screensaver events; NULL until X is ready */
+   unsigned x_source;
+   greeter_t * greeter;
    char * user;
    pid_t process;
+   unsigned long long x_start, start; /* for the registry */
+   int ssaver_base;
+   unsigned ssaver_source, close_source;
+   bool setting_up, closing, broken;
+   session_t * pending_session;
+   int return_vt; /* to switch back to once a spare is ready; 0 if none */
+   int slot; /* in the registry */
 } console_t;
 
 static GList * consoles;
+static GHashTable * console_index; /* display -> console */
+static GHashTable * greeter_index; /* greeter -> console */
+static GHashTable * session_index; /* user -> console of their latest session */
+static GQueue unused_consoles = G_QUEUE_INIT; /* without a session, oldest first */
 static int user_count;
-static char status[256];
+static GString * status;
+static unsigned update_source;
+static bool action_pending; /* sleep, reboot or shutdown still running */
+static bool handing_over; /* about to re-exec */
+static int stopping_x; /* X servers of closed consoles not yet reaped */
+
+#define REFILL_DELAY 5 /* seconds */
+#define MAX_REFILL_DELAY 300
+
+static unsigned refill_source;
+static int refill_delay = REFILL_DELAY; /* grows while X fails to start */
+static unsigned reap_source;
 
 static void update_ui (void) {
    for (GList * node = consoles; node; node = node->next) {
       console_t * console = node->data;
-      if (console->ui)
-         ui_update (console->ui, status, ! user_count);
-      else if (! console->user)
-         console->ui = ui_create (console->display, status, ! user_count);
+      greeter_update (console->greeter, status->str, ! action_pending,
+       ! user_count && ! action_pending);
+      if (! console->user)
+         greeter_show (console->greeter, NULL, NULL);
    }
 }
 
-static bool show_ui (console_t * console) {
-   if (! console->ui) {
-      console->ui = ui_create (console->display, status, ! user_count);
-      if (! console->ui)
-         return false;
-   }
-   return true;
+static void hide_ui (console_t * console) {
+   greeter_hide (console->greeter);
 }
 
-static void hide_ui (console_t * console) {
-   if (console->ui) {
-      ui_destroy (console->ui);
-      console->ui = NULL;
-   }
+static void make_record (console_t * console, record_t * r) {
+   * r = (record_t) {console->vt, console->disp_num, console->x_process,
+    console->process, console->x_start, console->start, console->user &&
+    greeter_shown (console->greeter), "", greeter_process (console->greeter),
+    greeter_start_time (console->greeter), handing_over ? greeter_hand_over
+    (console->greeter) : -1};
+   if (console->user)
+      g_strlcpy (r->user, console->user, sizeof r->user);
 }
 
-static console_t * open_console (void) {
-   int vt, disp_num;
-   start_x (& vt, & disp_num);
-   SPRINTF (disp_name, ":%d", disp_num);
-   GdkDisplay * display = gdk_display_open (disp_name);
-   if (! display)
-      fail2 ("gdk_display_open", disp_name);
-   ssaver_init (gdk_x11_display_get_xdisplay (display));
-   static const char * const args[] = {"j-login-setup", NULL};
-   wait_for_exit (launch_set_display (args, disp_num));
-   NEW (console_t, console, vt, disp_num, display, NULL, NULL, -1);
-   consoles = g_list_append (consoles, console);
-   return console;
+/* rewrites the console's own line, whatever the number of consoles */
+static void save_console (console_t * console) {
+   record_t r;
+   make_record (console, & r);
+   registry_update (console->slot, & r);
 }
 
-static console_t * get_unused_console (void) {
+/* the whole registry, compacted; at startup and before a re-exec */
+static void save_consoles (void) {
+   int count = 0;
+   record_t * records = my_malloc (sizeof (record_t) * (g_list_length (consoles) + 1));
    for (GList * node = consoles; node; node = node->next) {
       console_t * console = node->data;
-      if (! console->user)
-         return console;
+      console->slot = count;
+      make_record (console, & records[count ++]);
    }
-   return NULL;
+   registry_save (records, count);
+   free (records);
 }
 
-static bool lock_consoles (void) {
-   bool locked = true;
+/* a terminal server shows only the count, which is all that fits and all
+ * that users of a shared host should see of each other */
+static void update_sessions (void) {
+   g_string_assign (status, "Logged in:");
+   if (config->headless) {
+      g_string_append_printf (status, " %d", user_count);
+      return;
+   }
    for (GList * node = consoles; node; node = node->next) {
       console_t * console = node->data;
-      if (! show_ui (console))
-         locked = false;
+      if (console->user)
+         g_string_append_printf (status, " %s", console->user);
    }
-   return locked;
 }
 
-static void start_session (const char * user, const char * pass) {
-   console_t * console = get_unused_console ();
-   if (! console)
-      console = open_console ();
-   hide_ui (console);
-   set_vt (console->vt);
-   console->user = my_strdup (user);
-   static const char * const args[] = {"j-session", NULL};
-   console->process = launch_set_user (user, pass, console->vt, console->disp_num, args);
+/* NULL to clear; the index keeps pointing at the latest of several sessions */
+static void set_console_user (console_t * console, const char * user) {
+   if (console->user) {
+      if (g_hash_table_lookup (session_index, console->user) == console)
+         g_hash_table_remove (session_index, console->user);
+      free (console->user);
+      console->user = NULL;
+      user_count --;
+      g_queue_push_tail (& unused_consoles, console);
+   }
+   if (user) {
+      console->user = my_strdup (user);
+      g_hash_table_replace (session_index, console->user, console);
+      user_count ++;
+      g_queue_remove (& unused_consoles, console);
+   }
 }
 
-static bool try_activate_session (const char * user) {
-   for (GList * node = consoles; node; node = node->next) {
-      console_t * console = node->data;
-      if (console->user && ! strcmp (console->user, user)) {
-         hide_ui (console);
-         set_vt (console->vt);
-         return true;
-      }
+static int update_cb (void * unused) {
+   (void) unused;
+   update_source = 0;
+   update_sessions ();
+   update_ui ();
+   return G_SOURCE_REMOVE;
+}
+
+/* coalesces the UI updates from several exits into one */
+static void queue_update (void) {
+   if (! update_source)
+      update_source = g_idle_add (update_cb, NULL);
+}
+
+static int ssaver_lock_cb (void * data);
+
+static void ssaver_locked_cb (bool locked, void * data) {
+   console_t * console = data;
+   save_console (console);
+   if (! locked && ! console->ssaver_source)
+      console->ssaver_source = g_timeout_add_seconds (config->lock_retry,
+       ssaver_lock_cb, console);
+}
+
+static int ssaver_lock_cb (void * data) {
+   console_t * console = data;
+   console->ssaver_source = 0;
+   greeter_show (console->greeter, ssaver_locked_cb, console);
+   return G_SOURCE_REMOVE;
+}
+
+/* arms a one-shot timer for the time left until the lock is due */
+static void arm_ssaver (console_t * console) {
+   if (console->ssaver_source) {
+      g_source_remove (console->ssaver_source);
+      console->ssaver_source = 0;
    }
-   return false;
+   int active = (console->display && ! console->broken) ? ssaver_active_ms
+    (console->display) : -1;
+   if (active >= 0)
+      console->ssaver_source = g_timeout_add (MAX (config->lock_delay - active,
+       0), ssaver_lock_cb, console);
 }
 
-static void update_sessions (void) {
-   user_count = 0;
-   snprintf (status, sizeof status, "Logged in:");
-   for (GList * node = consoles; node; node = node->next) {
+/* a broken connection ends up in x_broken_cb */
+static int x_event_cb (int handle, GIOCondition condition, void * data) {
+   (void) handle;
+   (void) condition;
+   console_t * console = data;
+   while (! console->broken && XPending (console->display)) {
+      XEvent event;
+      XNextEvent (console->display, & event);
+      if (ssaver_is_notify (console->ssaver_base, & event))
+         arm_ssaver (console);
+   }
+   if (! console->broken)
+      return G_SOURCE_CONTINUE;
+   console->x_source = 0;
+   return G_SOURCE_REMOVE;
+}
+
+/* a closed console is freed once nothing that points at it is left */
+static void release_console (console_t * console) {
+   if (console->x_process >= 0 || console->process >= 0 || console->setting_up)
+      return;
+   free_console (console->vt, console->disp_num);
+   free (console);
+}
+
+/* an X server exiting on its own leaves Xlib to report the broken connection */
+static void x_exited_cb (pid_t process, void * data) {
+   (void) process;
+   console_t * console = data;
+   console->x_process = -1;
+   if (console->closing) {
+      stopping_x --;
+      release_console (console);
+   }
+}
+
+static int count_unused_consoles (void) {
+   return unused_consoles.length;
+}
+
+/* a session on the console is left to end along with its X server */
+static void close_console (console_t * console) {
+   consoles = g_list_remove (consoles, console);
+   g_hash_table_remove (console_index, GINT_TO_POINTER (console->disp_num));
+   g_hash_table_remove (greeter_index, console->greeter);
+   if (console->ssaver_source)
+      g_source_remove (console->ssaver_source);
+   if (console->close_source)
+      g_source_remove (console->close_source);
+   greeter_destroy (console->greeter);
+   if (console->x_source)
+      g_source_remove (console->x_source);
+   if (console->display)
+      XCloseDisplay (console->display);
+   if (console->user) {
+      set_console_user (console, NULL);
+      queue_update ();
+   }
+   g_queue_remove (& unused_consoles, console);
+   console->closing = true;
+   if (console->x_process >= 0) {
+      stop_x (console->x_process);
+      stopping_x ++;
+   }
+   registry_remove (console->slot);
+   release_console (console);
+}
+
+/* keeps the spare pool and whatever is on screen */
+static int reap_cb (void * unused) {
+   (void) unused;
+   int active_vt = get_vt ();
+   int excess = count_unused_consoles () - config->spare_consoles;
+   GList * node = consoles;
+   while (node && excess > 0) {
       console_t * console = node->data;
-      if (console->user) {
-         if (exited (console->process)) {
-            free (console->user);
-            console->user = NULL;
-            console->process = -1;
-         } else {
-            user_count ++;
-            int length = strlen (status);
-            snprintf (status + length, sizeof status - length, " %s", console->user);
-         }
+      node = node->next;
+      if (console->user || console->setting_up || console->vt == active_vt ||
+       greeter_busy (console->greeter))
+         continue;
+      close_console (console);
+      excess --;
+   }
+   reap_source = 0;
+   return G_SOURCE_REMOVE;
+}
+
+/* restarted whenever a session exits, so every unused console has been idle
+ * for at least ReapDelay seconds when the timer fires */
+static void queue_reap (void) {
+   if (reap_source)
+      g_source_remove (reap_source);
+   reap_source = g_timeout_add_seconds (config->reap_delay, reap_cb, NULL);
+}
+
+static void session_exited_cb (pid_t process, void * data) {
+   (void) process;
+   console_t * console = data;
+   console->process = -1;
+   if (console->closing) {
+      release_console (console);
+      return;
+   }
+   set_console_user (console, NULL);
+   console->start = 0;
+   save_console (console);
+   queue_reap ();
+   queue_update ();
+}
+
+static void launch_session (console_t * console, session_t * session) {
+   console->process = session_start (session, has_vts () ? console->vt : 0,
+    console->disp_num, session_exited_cb, console);
+   console->start = registry_start_time (console->process);
+   save_console (console);
+}
+
+/* j-login-setup runs while the greeter is already up; only a session has to
+ * wait for it */
+static void setup_done_cb (pid_t process, void * data) {
+   (void) process;
+   console_t * console = data;
+   trace_mark ("setup_done");
+   console->setting_up = false;
+   if (console->closing) {
+      if (console->pending_session)
+         session_cancel (console->pending_session);
+      release_console (console);
+   } else if (console->pending_session) {
+      launch_session (console, console->pending_session);
+      console->pending_session = NULL;
+   }
+}
+
+/* Bringing up a console is a pipeline: X is launched and the console listed
+ * (and its greeter started, if wanted) at once; the display is connected
+ * once X is ready, and j-login-setup then runs while the greeter paints. */
+
+static console_t * add_console (int vt, int disp_num, pid_t x_process) {
+   greeter_t * greeter = greeter_new (disp_num);
+   greeter_update (greeter, status->str, ! action_pending, ! user_count &&
+    ! action_pending);
+   NEW (console_t, console, vt, disp_num, x_process, NULL, 0, greeter, NULL,
+    -1, registry_start_time (x_process), 0, 0, 0, 0, false, false, false, NULL, 0,
+    -1);
+   consoles = g_list_append (consoles, console);
+   g_hash_table_insert (console_index, GINT_TO_POINTER (disp_num), console);
+   g_hash_table_insert (greeter_index, greeter, console);
+   g_queue_push_tail (& unused_consoles, console);
+   record_t r;
+   make_record (console, & r);
+   console->slot = registry_add (& r);
+   watch_exit (x_process, x_exited_cb, console);
+   return console;
+}
+
+/* returns NULL if the display cannot be opened */
+static Display * open_display (int disp_num) {
+   SPRINTF (disp_name, ":%d", disp_num);
+   trace_begin ("XOpenDisplay");
+   int64_t start = metrics_now ();
+   Display * display = XOpenDisplay (disp_name);
+   trace_end ("XOpenDisplay");
+   if (display)
+      metrics_observe (HIST_DISPLAY_OPEN, start);
+   return display;
+}
+
+static int close_broken_cb (void * data) {
+   console_t * console = data;
+   console->close_source = 0;
+   close_console (console);
+   return G_SOURCE_REMOVE;
+}
+
+/* called by Xlib, which would otherwise exit, when the connection to an X
+ * server breaks; only that console is closed, once Xlib has unwound */
+static void x_broken_cb (Display * display, void * data) {
+   (void) display;
+   console_t * console = data;
+   if (console->broken)
+      return;
+   console->broken = true;
+   SPRINTF (message, "lost connection to :%d", console->disp_num);
+   warning (message);
+   console->close_source = g_idle_add (close_broken_cb, console);
+}
+
+static void connect_console (console_t * console, Display * display) {
+   console->display = display;
+   XSetIOErrorExitHandler (display, x_broken_cb, console);
+   console->ssaver_base = ssaver_init (display);
+   console->x_source = g_unix_fd_add (ConnectionNumber (display), G_IO_IN,
+    x_event_cb, console);
+   arm_ssaver (console);
+   greeter_ready (console->greeter, display);
+}
+
+static console_t * find_console (int disp_num) {
+   return g_hash_table_lookup (console_index, GINT_TO_POINTER (disp_num));
+}
+
+static void queue_refill (void);
+
+static void back_off_refill (void) {
+   refill_delay = MIN (refill_delay * 2, MAX_REFILL_DELAY);
+   queue_refill ();
+}
+
+/* e.g. after a bad XArguments: only this console is lost, its VT and display
+ * go back to the pools once X has exited, and refills back off */
+static void x_failed (console_t * console) {
+   SPRINTF (message, "X server on :%d failed to start", console->disp_num);
+   warning (message);
+   console->setting_up = false;
+   if (console->pending_session) {
+      session_cancel (console->pending_session);
+      console->pending_session = NULL;
+   }
+   close_console (console);
+   back_off_refill ();
+   queue_update ();
+}
+
+static void display_ready_cb (int disp_num, bool ready) {
+   console_t * console = find_console (disp_num);
+   Display * display = ready ? open_display (disp_num) : NULL;
+   if (! display) {
+      x_failed (console);
+      return;
+   }
+   refill_delay = REFILL_DELAY;
+   connect_console (console, display);
+   /* X takes its VT as it starts, even a spare; give the screen back unless
+    * the user has gone elsewhere in the meantime */
+   if (console->return_vt && get_vt () == console->vt)
+      set_vt (console->return_vt, NULL, NULL);
+   console->return_vt = 0;
+   static const char * const args[] = {"j-login-setup", NULL};
+   trace_mark ("setup_start");
+   pid_t process = launch_set_display (args, disp_num);
+   if (process < 0)
+      setup_done_cb (process, console);
+   else
+      watch_exit (process, setup_done_cb, console);
+}
+
+/* a spare is started in the background, leaving the screen where it was;
+ * NULL if X cannot be launched */
+static console_t * open_console (bool spare) {
+   int vt, disp_num;
+   int active_vt = get_vt ();
+   pid_t x_process = start_x (& vt, & disp_num, spare, display_ready_cb);
+   if (x_process < 0) {
+      back_off_refill ();
+      return NULL;
+   }
+   console_t * console = add_console (vt, disp_num, x_process);
+   console->setting_up = true;
+   if (spare && active_vt > 0)
+      console->return_vt = active_vt;
+   return console;
+}
+
+/* picks up the consoles left by an earlier j-login, which keeps the sessions
+ * on them running; a session that was locked stays locked.  An X server that
+ * cannot be connected to is left alone, since it may still hold a session,
+ * and merely drops out of the registry; its VT and display stay taken. */
+static void restore_consoles (void) {
+   trace_begin ("restore_consoles");
+   int count;
+   record_t * records = registry_load (& count);
+   for (int i = 0; i < count; i ++) {
+      const record_t * r = & records[i];
+      reserve_console (r->vt, r->display);
+      Display * display = open_display (r->display);
+      if (! display) {
+         SPRINTF (message, "cannot connect to :%d; leaving it alone", r->display);
+         warning (message);
+         continue;
+      }
+      console_t * console = add_console (r->vt, r->display, r->x_process);
+      if (r->greeter >= 0)
+         greeter_adopt (console->greeter, r->greeter, r->greeter_start,
+          r->greeter_handle);
+      connect_console (console, display);
+      if (r->process >= 0) {
+         set_console_user (console, r->user);
+         console->process = r->process;
+         console->start = r->start;
+         watch_exit (r->process, session_exited_cb, console);
+         if (r->locked)
+            greeter_show (console->greeter, NULL, NULL);
+         else
+            greeter_hide (console->greeter);
       }
    }
+   free (records);
+   save_consoles ();
+   trace_end ("restore_consoles");
 }
 
-static int update_cb (void * unused) {
+static console_t * get_unused_console (void) {
+   return g_queue_peek_head (& unused_consoles);
+}
+
+/* with no console at all (the first one failed), one is wanted regardless */
+static int wanted_unused (void) {
+   return consoles ? config->spare_consoles : MAX (config->spare_consoles, 1);
+}
+
+/* opens one spare console per call, leaving the screen alone; the greeter is
+ * started at once, so that it loads while X starts */
+static int refill_cb (void * unused) {
    (void) unused;
-   update_sessions ();
-   update_ui ();
+   refill_source = 0;
+   if (count_unused_consoles () < wanted_unused ()) {
+      open_console (consoles != NULL);
+      update_ui ();
+   }
+   if (! refill_source && count_unused_consoles () < wanted_unused ())
+      refill_source = g_timeout_add_seconds (refill_delay, refill_cb, NULL);
    return G_SOURCE_REMOVE;
 }
 
+/* restarted on every login so that refills stay out of the way */
+static void queue_refill (void) {
+   if (refill_source)
+      g_source_remove (refill_source);
+   refill_source = g_timeout_add_seconds (refill_delay, refill_cb, NULL);
+}
+
+static void use_console (console_t * console, const char * user,
+ session_t * session) {
+   hide_ui (console);
+   set_console_user (console, user);
+   /* a login on a spare still starting keeps it on screen */
+   console->return_vt = 0;
+   if (console->setting_up)
+      console->pending_session = session;
+   else
+      launch_session (console, session);
+   queue_refill ();
+}
+
+/* false if no console could be opened for it */
+static bool start_session (const char * user, session_t * session) {
+   console_t * console = get_unused_console ();
+   if (! console)
+      console = open_console (false);
+   if (! console) {
+      session_cancel (session);
+      return false;
+   }
+   set_vt (console->vt, NULL, NULL);
+   use_console (console, user, session);
+   return true;
+}
+
+static console_t * find_session (const char * user) {
+   return g_hash_table_lookup (session_index, user);
+}
+
+static bool try_activate_session (const char * user) {
+   console_t * console = find_session (user);
+   if (! console)
+      return false;
+   hide_ui (console);
+   set_vt (console->vt, NULL, NULL);
+   save_console (console);
+   return true;
+}
+
 static int popup_cb (void * unused) {
    (void) unused;
-   lock_consoles ();
-   return G_SOURCE_REMOVE;
+   lock_all (NULL, NULL);
+   return G_SOURCE_CONTINUE;
+}
+
+static int dump_cb (void * unused) {
+   (void) unused;
+   trace_dump ();
+   return G_SOURCE_CONTINUE;
 }
 
-static int ssaver_cb (void * unused) {
+/* replaces this process with a (possibly upgraded) j-login, which takes the
+ * consoles, and the greeters' sockets, back from the registry; waits for
+ * logins in progress to finish, and for every child it would not know about
+ * to exit, since the new image could not reap them */
+static int reexec_cb (void * unused) {
    (void) unused;
+   bool busy = action_pending || stopping_x || greeter_any_stopping ();
    for (GList * node = consoles; node; node = node->next) {
       console_t * console = node->data;
-      Display * xdisplay = gdk_x11_display_get_xdisplay (console->display);
-      if (ssaver_active_ms (xdisplay) > 60000)
-         show_ui (console);
+      if (console->setting_up || greeter_busy (console->greeter))
+         busy = true;
+   }
+   if (busy) {
+      g_timeout_add_seconds (1, reexec_cb, NULL);
+      return G_SOURCE_REMOVE;
    }
+   zygote_stop ();
+   handing_over = true;
+   save_consoles ();
+   trace_mark ("reexec");
+   static const char * const args[] = {"j-login", NULL};
+   execvp (args[0], (char * const *) args);
+   fail2 ("execvp", args[0]);
+   return G_SOURCE_REMOVE;
+}
+
+static int hangup_cb (void * unused) {
+   reexec_cb (unused);
    return G_SOURCE_CONTINUE;
 }
 
-static void * signal_thread (void * unused) {
+/* a stop (or a shutdown) takes the X servers, and with them the sessions,
+ * down along with every greeter, including any left by a crash; only a
+ * re-exec, or a restart after a crash, hands the consoles over */
+static int terminate_cb (void * unused) {
    (void) unused;
-   sigset_t signals;
-   sigemptyset (& signals);
-   sigaddset (& signals, SIGCHLD);
-   sigaddset (& signals, SIGUSR1);
-   int signal;
-   while (! sigwait (& signals, & signal)) {
-      if (signal == SIGCHLD)
-         g_timeout_add (0, update_cb, NULL);
-      else if (signal == SIGUSR1)
-         g_timeout_add (0, popup_cb, NULL);
-   }
-   fail ("sigwait");
-   return 0;
+   trace_mark ("terminate");
+   while (consoles)
+      close_console (consoles->data);
+   save_consoles ();
+   zygote_stop ();
+   exit (0);
 }
 
-static void start_signal_thread (void) {
-   sigset_t signals;
-   sigemptyset (& signals);
-   sigaddset (& signals, SIGCHLD);
-   sigaddset (& signals, SIGUSR1);
-   if (sigprocmask (SIG_SETMASK, & signals, NULL) < 0)
-      fail ("sigprocmask");
-   pthread_t thread;
-   if (pthread_create (& thread, NULL, signal_thread, NULL) < 0)
-      fail ("pthread_create");
-}
+typedef struct {
+   char * name;
+   log_in_cb callback;
+   void * data;
+} login_t;
 
-bool log_in (const char * name, const char * password) {
-   if (! strcmp (name, "root") || ! check_password (name, password))
+/* every console of a terminal server has its own viewer, so the session goes
+ * where the login was made (unless it has been closed meanwhile), and a
+ * locked one can only be unlocked */
+static bool headless_log_in (console_t * console, const char * user,
+ session_t * session) {
+   if (! console) {
+      session_cancel (session);
       return false;
-   if (try_activate_session (name))
+   }
+   if (console->user) {
+      session_cancel (session);
+      if (strcmp (console->user, user))
+         return false;
+      hide_ui (console);
+      save_console (console);
       return true;
-   start_session (name, password);
+   }
+   use_console (console, user, session);
    update_cb (NULL);
    return true;
 }
 
+static void authenticated_cb (session_t * session, void * data) {
+   login_t * login = data;
+   metrics_count (session ? COUNT_LOGINS : COUNT_AUTH_FAILURES);
+   bool success = (session != NULL);
+   if (session && config->headless)
+      success = headless_log_in (g_hash_table_lookup (greeter_index, login->data),
+       login->name, session);
+   else if (session) {
+      if (try_activate_session (login->name))
+         session_cancel (session);
+      else {
+         success = start_session (login->name, session);
+         update_cb (NULL);
+      }
+   }
+   login->callback (success, login->data);
+   free (login->name);
+   free (login);
+}
+
+void log_in (const char * name, const char * password, log_in_cb callback,
+ void * data) {
+   if (! strcmp (name, "root")) {
+      callback (false, data);
+      return;
+   }
+   NEW (login_t, login, my_strdup (name), callback, data);
+   authenticate_async (name, password, authenticated_cb, login);
+}
+
+static void action_done_cb (pid_t process, void * unused) {
+   (void) process;
+   (void) unused;
+   action_pending = false;
+   update_ui ();
+}
+
+/* the buttons stay disabled until the action finishes */
+static void start_action (const char * const * args) {
+   if (action_pending)
+      return;
+   pid_t process = launch (args);
+   if (process < 0)
+      return;
+   action_pending = true;
+   update_ui ();
+   watch_exit (process, action_done_cb, NULL);
+}
+
+typedef struct {
+   int pending;
+   bool locked;
+   lock_cb callback;
+   void * data;
+   int64_t start;
+} lock_t;
+
+static void console_locked_cb (bool locked, void * data) {
+   lock_t * lock = data;
+   if (! locked)
+      lock->locked = false;
+   if (-- lock->pending)
+      return;
+   metrics_observe (HIST_LOCK, lock->start);
+   for (GList * node = consoles; node; node = node->next)
+      save_console (node->data);
+   if (lock->callback)
+      lock->callback (lock->locked, lock->data);
+   free (lock);
+}
+
+/* grabs are attempted on all consoles at once, so locking takes as long as
+ * the slowest console rather than the sum of them; callback may be NULL */
+void lock_all (lock_cb callback, void * data) {
+   NEW (lock_t, lock, 1, true, callback, data, metrics_now ());
+   for (GList * node = consoles; node; node = node->next) {
+      console_t * console = node->data;
+      lock->pending ++;
+      greeter_show (console->greeter, console_locked_cb, lock);
+   }
+   /* drops the count held while the loop runs */
+   console_locked_cb (true, lock);
+}
+
+char * describe_sessions (void) {
+   GString * text = g_string_new ("");
+   for (GList * node = consoles; node; node = node->next) {
+      console_t * console = node->data;
+      g_string_append_printf (text, "%d :%d %s\n", console->vt,
+       console->disp_num, console->user ? console->user : "-");
+   }
+   return g_string_free (text, false);
+}
+
+char * describe_metrics (void) {
+   GString * text = g_string_new ("");
+   metrics_print (text);
+   g_string_append_printf (text, "# TYPE jlogin_consoles gauge\n"
+    "jlogin_consoles %d\n# TYPE jlogin_users gauge\njlogin_users %d\n",
+    g_list_length (consoles), user_count);
+   g_string_append (text, "# TYPE jlogin_rss_bytes gauge\n"
+    "# TYPE jlogin_pss_bytes gauge\n");
+   metrics_print_memory (text, getpid (), "process=\"j-login\"");
+   for (GList * node = consoles; node; node = node->next) {
+      console_t * console = node->data;
+      SPRINTF (labels, "process=\"X\",display=\":%d\"", console->disp_num);
+      metrics_print_memory (text, console->x_process, labels);
+      pid_t greeter = greeter_process (console->greeter);
+      if (greeter >= 0) {
+         SPRINTF (labels2, "process=\"greeter\",display=\":%d\"",
+          console->disp_num);
+         metrics_print_memory (text, greeter, labels2);
+      }
+   }
+   return g_string_free (text, false);
+}
+
+/* only switches VT; a locked session stays locked */
+bool activate_session (const char * user) {
+   console_t * console = find_session (user);
+   if (! console)
+      return false;
+   set_vt (console->vt, NULL, NULL);
+   return true;
+}
+
 void do_sleep (void) {
    static const char * const args[] = {"j-login-sleep", NULL};
-   wait_for_exit (launch (args));
+   start_action (args);
 }
 
 void queue_reboot (void) {
-   const char * const args[] = {"reboot", NULL};
-   wait_for_exit (launch (args));
+   static const char * const args[] = {"reboot", NULL};
+   start_action (args);
 }
 
 void queue_shutdown (void) {
-   const char * const args[] = {"poweroff", NULL};
-   wait_for_exit (launch (args));
+   static const char * const args[] = {"poweroff", NULL};
+   start_action (args);
+}
+
+/* values read where they are used need nothing more than the new config; the
+ * greeters are told to re-read the file, rather than each watching /etc */
+static void config_changed (const config_t * old) {
+   for (GList * node = consoles; node; node = node->next) {
+      console_t * console = node->data;
+      greeter_reload (console->greeter);
+   }
+   if (config->lock_delay != old->lock_delay)
+      for (GList * node = consoles; node; node = node->next)
+         arm_ssaver (node->data);
+   if (config->spare_consoles > old->spare_consoles)
+      queue_refill ();
+   else if (config->spare_consoles < old->spare_consoles)
+      queue_reap ();
 }
 
 int main (void) {
    set_user ("root");
+   /* reaps whatever an earlier image of this process left exiting */
+   while (waitpid (-1, NULL, WNOHANG) > 0) {}
+   config_init (config_changed);
+   config_watch ();
+   trace_init ();
+   console_index = g_hash_table_new (NULL, NULL);
+   greeter_index = g_hash_table_new (NULL, NULL);
+   session_index = g_hash_table_new (g_str_hash, g_str_equal);
+   status = g_string_new ("");
+   zygote_start ();
+   trace_begin ("init_vt");
    init_vt ();
-   if (! gtk_parse_args (NULL, NULL))
-      fail ("gtk_parse_args");
-   console_t * console = open_console ();
-   GdkDisplayManager * dm = gdk_display_manager_get ();
-   gdk_display_manager_set_default_display (dm, console->display);
-   start_signal_thread ();
-   g_timeout_add_seconds (10, ssaver_cb, NULL);
+   trace_end ("init_vt");
+   restore_consoles ();
+   /* the rest of startup, and the greeter, overlap the X server starting */
+   if (! count_unused_consoles ())
+      open_console (false);
+   g_unix_signal_add (SIGUSR1, popup_cb, NULL);
+   g_unix_signal_add (SIGUSR2, dump_cb, NULL);
+   g_unix_signal_add (SIGHUP, hangup_cb, NULL);
+   g_unix_signal_add (SIGTERM, terminate_cb, NULL);
+   control_init ();
+   logind_init ();
+   /* shows the greeter on every console without a session */
    update_cb (NULL);
-   show_ui (console);
-   gtk_main ();
+   g_main_loop_run (g_main_loop_new (NULL, false));
    return 0;
 }
@@ -0,0 +1,127 @@
+/*
+ * J-Login - logind.c
+ * Copyright 2019 John Lindgren
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions, and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions, and the following disclaimer in the documentation
+ *    provided with the distribution.
+ *
+ * This software is provided "as is" and without any warranty, express or
+ * implied. In no event shall the authors be liable for any damages arising from
+ * the use of this software.
+ */
+
+/* Holds a logind delay inhibitor for sleep, so that suspend waits exactly as
+ * long as it takes to lock every console. */
+
+#include <unistd.h>
+
+#include <gio/gio.h>
+#include <gio/gunixfdlist.h>
+
+#include "actions.h"
+#include "logind.h"
+#include "utils.h"
+
+#define LOGIND_NAME "org.freedesktop.login1"
+#define LOGIND_PATH "/org/freedesktop/login1"
+#define LOGIND_MANAGER "org.freedesktop.login1.Manager"
+
+static GDBusConnection * bus;
+static int inhibitor = -1;
+static bool inhibiting;
+static bool lock_failed; /* before the last sleep */
+
+static void inhibited_cb (GObject * source, GAsyncResult * result, void * unused) {
+   (void) source;
+   (void) unused;
+   GUnixFDList * fds = NULL;
+   GError * error = NULL;
+   GVariant * reply = g_dbus_connection_call_with_unix_fd_list_finish (bus,
+    & fds, result, & error);
+   inhibiting = false;
+   if (reply) {
+      int index;
+      g_variant_get (reply, "(h)", & index);
+      inhibitor = g_unix_fd_list_get (fds, index, & error);
+      g_variant_unref (reply);
+      g_object_unref (fds);
+   }
+   if (error) {
+      warning (error->message);
+      g_error_free (error);
+   }
+}
+
+static void take_inhibitor (void) {
+   if (inhibitor >= 0 || inhibiting)
+      return;
+   inhibiting = true;
+   g_dbus_connection_call_with_unix_fd_list (bus, LOGIND_NAME, LOGIND_PATH,
+    LOGIND_MANAGER, "Inhibit", g_variant_new ("(ssss)", "sleep", NAME,
+    "Lock the screen", "delay"), G_VARIANT_TYPE ("(h)"),
+    G_DBUS_CALL_FLAGS_NONE, -1, NULL, NULL, inhibited_cb, NULL);
+}
+
+static void release_inhibitor (void) {
+   if (inhibitor >= 0) {
+      close (inhibitor);
+      inhibitor = -1;
+   }
+}
+
+/* sleep goes ahead even if a grab failed; the lock is retried on resume */
+static void locked_cb (bool locked, void * unused) {
+   (void) unused;
+   if (! locked)
+      warning ("could not lock all consoles before sleep");
+   lock_failed = ! locked;
+   release_inhibitor ();
+}
+
+static void prepare_for_sleep_cb (GDBusConnection * connection,
+ const char * sender, const char * path, const char * interface,
+ const char * signal, GVariant * params, void * unused) {
+   (void) connection;
+   (void) sender;
+   (void) path;
+   (void) interface;
+   (void) signal;
+   (void) unused;
+   gboolean start;
+   g_variant_get (params, "(b)", & start);
+   if (start)
+      lock_all (locked_cb, NULL);
+   else {
+      if (lock_failed)
+         lock_all (NULL, NULL);
+      lock_failed = false;
+      take_inhibitor ();
+   }
+}
+
+static void bus_cb (GObject * source, GAsyncResult * result, void * unused) {
+   (void) source;
+   (void) unused;
+   GError * error = NULL;
+   bus = g_bus_get_finish (result, & error);
+   if (! bus) {
+      warning (error->message);
+      g_error_free (error);
+      return;
+   }
+   g_dbus_connection_signal_subscribe (bus, LOGIND_NAME, LOGIND_MANAGER,
+    "PrepareForSleep", LOGIND_PATH, NULL, G_DBUS_SIGNAL_FLAGS_NONE,
+    prepare_for_sleep_cb, NULL, NULL);
+   take_inhibitor ();
+}
+
+void logind_init (void) {
+   g_bus_get (G_BUS_TYPE_SYSTEM, NULL, bus_cb, NULL);
+}
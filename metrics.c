@@ -0,0 +1,116 @@
+/*
+ * J-Login - metrics.c
+ * Copyright 2019 John Lindgren
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions, and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions, and the following disclaimer in the documentation
+ *    provided with the distribution.
+ *
+ * This software is provided "as is" and without any warranty, express or
+ * implied. In no event shall the authors be liable for any damages arising from
+ * the use of this software.
+ */
+
+/* Counters and histograms in Prometheus text format.  Everything is updated
+ * incrementally; only the memory gauges read /proc, and only for the few
+ * processes asked about. */
+
+#include <stdio.h>
+#include <time.h>
+
+#include "metrics.h"
+
+static const double bounds[] = {0.005, 0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1,
+ 2.5, 5, 10};
+
+#define N_BUCKETS (int) G_N_ELEMENTS (bounds)
+
+typedef struct {
+   const char * name, * help;
+   int64_t buckets[N_BUCKETS + 1];
+   double sum;
+   int64_t count;
+} hist_data_t;
+
+static hist_data_t hists[N_HISTS] = {
+   {"jlogin_start_x_seconds", "Time from launching X until it is ready", {0}, 0, 0},
+   {"jlogin_display_open_seconds", "Time spent in XOpenDisplay", {0}, 0, 0},
+   {"jlogin_auth_seconds", "Time taken by PAM authentication", {0}, 0, 0},
+   {"jlogin_greeter_start_seconds", "Time from asking a greeter to show until it is shown", {0}, 0, 0},
+   {"jlogin_lock_seconds", "Time from a lock request until all grabs are held", {0}, 0, 0},
+   {"jlogin_vt_switch_seconds", "Time from VT_ACTIVATE until the new VT is active", {0}, 0, 0}
+};
+
+static const char * const count_names[N_COUNTS] = {
+   "jlogin_logins_total",
+   "jlogin_auth_failures_total",
+   "jlogin_grab_failures_total"
+};
+
+static int64_t counts[N_COUNTS];
+
+int64_t metrics_now (void) {
+   struct timespec now;
+   clock_gettime (CLOCK_MONOTONIC, & now);
+   return (int64_t) now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+/* start is a value returned earlier by metrics_now */
+void metrics_observe (hist_t hist, int64_t start) {
+   hist_data_t * data = & hists[hist];
+   double seconds = (metrics_now () - start) / 1e6;
+   int bucket = 0;
+   while (bucket < N_BUCKETS && seconds > bounds[bucket])
+      bucket ++;
+   data->buckets[bucket] ++;
+   data->sum += seconds;
+   data->count ++;
+}
+
+void metrics_count (count_t count) {
+   counts[count] ++;
+}
+
+void metrics_print (GString * out) {
+   for (int h = 0; h < N_HISTS; h ++) {
+      const hist_data_t * data = & hists[h];
+      g_string_append_printf (out, "# HELP %s %s.\n# TYPE %s histogram\n",
+       data->name, data->help, data->name);
+      int64_t total = 0;
+      for (int b = 0; b < N_BUCKETS; b ++) {
+         total += data->buckets[b];
+         g_string_append_printf (out, "%s_bucket{le=\"%g\"} %lld\n",
+          data->name, bounds[b], (long long) total);
+      }
+      g_string_append_printf (out, "%s_bucket{le=\"+Inf\"} %lld\n%s_sum %f\n"
+       "%s_count %lld\n", data->name, (long long) data->count, data->name,
+       data->sum, data->name, (long long) data->count);
+   }
+   for (int c = 0; c < N_COUNTS; c ++)
+      g_string_append_printf (out, "# TYPE %s counter\n%s %lld\n",
+       count_names[c], count_names[c], (long long) counts[c]);
+}
+
+/* labels is inserted as is, e.g. "process=\"X\",display=\":0\"" */
+void metrics_print_memory (GString * out, pid_t process, const char * labels) {
+   char path[64];
+   snprintf (path, sizeof path, "/proc/%d/smaps_rollup", (int) process);
+   FILE * file = fopen (path, "r");
+   if (! file)
+      return;
+   char line[256];
+   long long kb;
+   while (fgets (line, sizeof line, file)) {
+      if (sscanf (line, "Rss: %lld kB", & kb) == 1)
+         g_string_append_printf (out, "jlogin_rss_bytes{%s} %lld\n", labels, kb * 1024);
+      else if (sscanf (line, "Pss: %lld kB", & kb) == 1)
+         g_string_append_printf (out, "jlogin_pss_bytes{%s} %lld\n", labels, kb * 1024);
+   }
+   fclose (file);
+}
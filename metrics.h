@@ -0,0 +1,51 @@
+/*
+ * J-Login - metrics.h
+ * Copyright 2019 John Lindgren
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions, and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions, and the following disclaimer in the documentation
+ *    provided with the distribution.
+ *
+ * This software is provided "as is" and without any warranty, express or
+ * implied. In no event shall the authors be liable for any damages arising from
+ * the use of this software.
+ */
+
+#ifndef JLOGIN_METRICS_H
+#define JLOGIN_METRICS_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include <glib.h>
+
+typedef enum {
+   HIST_START_X,
+   HIST_DISPLAY_OPEN,
+   HIST_AUTH,
+   HIST_GREETER_START,
+   HIST_LOCK,
+   HIST_VT_SWITCH,
+   N_HISTS
+} hist_t;
+
+typedef enum {
+   COUNT_LOGINS,
+   COUNT_AUTH_FAILURES,
+   COUNT_GRAB_FAILURES,
+   N_COUNTS
+} count_t;
+
+int64_t metrics_now (void);
+void metrics_observe (hist_t hist, int64_t start);
+void metrics_count (count_t count);
+void metrics_print (GString * out);
+void metrics_print_memory (GString * out, pid_t process, const char * labels);
+
+#endif
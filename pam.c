@@ -17,17 +17,20 @@
  * the use of this software.
  */
 
+#include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <security/pam_appl.h>
 
+#include "config.h"
 #include "pam.h"
+#include "trace.h"
 #include "utils.h"
 
 static int callback (int count, const struct pam_message * * msgs,
  struct pam_response * * resps, void * pass) {
-   if (count != 1 || (* msgs)->msg_style != PAM_PROMPT_ECHO_OFF)
+   if (! pass || count != 1 || (* msgs)->msg_style != PAM_PROMPT_ECHO_OFF)
       return PAM_CONV_ERR;
    NEW (struct pam_response, resp, my_strdup (pass), 0);
    * resps = resp;
@@ -49,26 +52,62 @@ static void import_pam_env (pam_handle_t * handle) {
    free (envlist);
 }
 
-void * open_pam (const char * user, const char * pass, int vt, int display) {
+/* pam_start_confdir is new in PAM 1.4; the Makefile checks for it */
+static int begin (const char * user, const struct pam_conv * conv,
+ pam_handle_t * * handle) {
+#ifdef HAVE_PAM_START_CONFDIR
+   if (config->pam_conf_dir)
+      return pam_start_confdir (config->pam_service, user, conv,
+       config->pam_conf_dir, handle);
+#else
+   if (config->pam_conf_dir)
+      warning ("PamConfDir needs PAM 1.4; using the system's configuration");
+#endif
+   return pam_start (config->pam_service, user, conv, handle);
+}
+
+/* authenticates once; the same transaction is later used to open the session */
+void * start_pam (const char * user, const char * pass) {
    struct pam_conv conv = {callback, (void *) pass};
    pam_handle_t * handle;
-   if (pam_start ("login", user, & conv, & handle) != PAM_SUCCESS)
+   if (begin (user, & conv, & handle) != PAM_SUCCESS)
       fail ("pam_start");
-   if (pam_authenticate (handle, 0) != PAM_SUCCESS)
-      fail ("pam_authenticate");
+   trace_begin ("pam_authenticate");
+   bool success = (pam_authenticate (handle, 0) == PAM_SUCCESS &&
+    pam_acct_mgmt (handle, 0) == PAM_SUCCESS);
+   trace_end ("pam_authenticate");
+   if (! success) {
+      pam_end (handle, PAM_SUCCESS);
+      return NULL;
+   }
+   /* the password does not outlive this call */
+   struct pam_conv no_conv = {callback, NULL};
+   pam_set_item (handle, PAM_CONV, & no_conv);
+   return handle;
+}
+
+/* vt is 0 for a display with no VT, which logind must not take for a seat's */
+void open_pam (void * handle, int vt, int display) {
    SPRINTF (vt_name, "/dev/tty%d", vt);
-   pam_set_item (handle, PAM_TTY, vt_name);
    SPRINTF (disp_name, ":%d", display);
+   pam_set_item (handle, PAM_TTY, vt ? vt_name : disp_name);
    pam_set_item (handle, PAM_XDISPLAY, disp_name);
+   trace_begin ("pam_setcred");
    if (pam_setcred (handle, PAM_ESTABLISH_CRED) != PAM_SUCCESS)
       fail ("pam_setcred");
+   trace_end ("pam_setcred");
+   trace_begin ("pam_open_session");
    if (pam_open_session (handle, 0) != PAM_SUCCESS)
       fail ("pam_open_session");
+   trace_end ("pam_open_session");
    import_pam_env (handle);
-   return handle;
 }
 
 void close_pam (void * handle) {
    pam_close_session (handle, 0);
    pam_end (handle, PAM_SUCCESS);
 }
+
+void end_pam (void * handle) {
+   pam_end (handle, PAM_SUCCESS);
+}
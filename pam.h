@@ -20,7 +20,9 @@
 #ifndef JLOGIN_PAM_H
 #define JLOGIN_PAM_H
 
-void * open_pam (const char * user, const char * pass, int vt, int display);
+void * start_pam (const char * user, const char * pass);
+void open_pam (void * handle, int vt, int display);
 void close_pam (void * handle);
+void end_pam (void * handle);
 
 #endif
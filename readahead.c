@@ -0,0 +1,220 @@
+/*
+ * J-Login - readahead.c
+ * Copyright 2019 John Lindgren
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions, and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions, and the following disclaimer in the documentation
+ *    provided with the distribution.
+ *
+ * This software is provided "as is" and without any warranty, express or
+ * implied. In no event shall the authors be liable for any damages arising from
+ * the use of this software.
+ */
+
+/* A session starts on a cold page cache: j-session, the shell profiles and
+ * whatever ~/.xsession runs all wait on the disk in turn.  So the files a
+ * user's processes have open or mapped during the first seconds of each
+ * session are recorded (by sampling /proc, which needs nothing beyond root),
+ * and on the next login they are read ahead while PAM is still checking the
+ * password.  Both run in processes forked by the zygote, never in j-login's
+ * main loop. */
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <pwd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <glib.h>
+
+#include "config.h"
+#include "readahead.h"
+#include "trace.h"
+#include "utils.h"
+
+#define SAMPLE_INTERVAL 500 /* milliseconds */
+#define SAMPLES 20
+#define MAX_FILES 4096
+
+typedef struct {
+   char * path;
+   dev_t dev;
+   ino_t ino;
+} file_t;
+
+typedef struct {
+   uid_t uid;
+   GHashTable * seen;
+   GArray * files;
+} recording_t;
+
+/* NULL unless user names an account; the name comes straight from the
+ * greeter, before any authentication */
+static char * profile_path (const char * user) {
+   if (! user[0] || strchr (user, '/') || ! getpwnam (user))
+      return NULL;
+   char * dir = state_path (READAHEAD_DIR);
+   char * path = g_build_filename (dir, user, NULL);
+   g_free (dir);
+   return path;
+}
+
+/* virtual and memory-backed files are not worth reading ahead */
+static bool skip_path (const char * path) {
+   static const char * const prefixes[] = {"/dev/", "/proc/", "/run/",
+    "/sys/", "/tmp/"};
+   for (unsigned i = 0; i < G_N_ELEMENTS (prefixes); i ++) {
+      if (g_str_has_prefix (path, prefixes[i]))
+         return true;
+   }
+   return false;
+}
+
+static void add_file (recording_t * rec, const char * path) {
+   struct stat s;
+   if (rec->files->len >= MAX_FILES || path[0] != '/' || skip_path (path) ||
+    g_hash_table_contains (rec->seen, path))
+      return;
+   char * copy = my_strdup (path);
+   g_hash_table_add (rec->seen, copy);
+   if (stat (path, & s) < 0 || ! S_ISREG (s.st_mode))
+      return;
+   file_t file = {copy, s.st_dev, s.st_ino};
+   g_array_append_val (rec->files, file);
+}
+
+static void sample_maps (recording_t * rec, const char * pid) {
+   SPRINTF (path, "/proc/%s/maps", pid);
+   FILE * file = fopen (path, "r");
+   if (! file)
+      return;
+   char line[4096];
+   while (fgets (line, sizeof line, file)) {
+      char * name = strchr (line, '/');
+      if (! name || ! g_str_has_suffix (name, "\n"))
+         continue;
+      name[strlen (name) - 1] = 0;
+      if (! g_str_has_suffix (name, " (deleted)"))
+         add_file (rec, name);
+   }
+   fclose (file);
+}
+
+static void sample_fds (recording_t * rec, const char * pid) {
+   SPRINTF (path, "/proc/%s/fd", pid);
+   DIR * dir = opendir (path);
+   if (! dir)
+      return;
+   struct dirent * entry;
+   while ((entry = readdir (dir))) {
+      SPRINTF (fd_path, "%s/%s", path, entry->d_name);
+      char target[4096];
+      int length = readlink (fd_path, target, sizeof target - 1);
+      if (length > 0) {
+         target[length] = 0;
+         add_file (rec, target);
+      }
+   }
+   closedir (dir);
+}
+
+/* every process of the user counts, whichever session it belongs to */
+static void sample (recording_t * rec) {
+   DIR * dir = opendir ("/proc");
+   if (! dir)
+      return;
+   struct dirent * entry;
+   while ((entry = readdir (dir))) {
+      struct stat s;
+      SPRINTF (path, "/proc/%s", entry->d_name);
+      if (entry->d_name[0] < '0' || entry->d_name[0] > '9' || stat (path, & s)
+       < 0 || s.st_uid != rec->uid)
+         continue;
+      sample_maps (rec, entry->d_name);
+      sample_fds (rec, entry->d_name);
+   }
+   closedir (dir);
+}
+
+/* in disk order, near enough, so that a spinning disk seeks less */
+static int compare_files (const void * a, const void * b) {
+   const file_t * fa = a, * fb = b;
+   if (fa->dev != fb->dev)
+      return fa->dev < fb->dev ? -1 : 1;
+   return fa->ino < fb->ino ? -1 : fa->ino > fb->ino;
+}
+
+static void save (recording_t * rec, const char * path) {
+   char * dir = state_path (READAHEAD_DIR);
+   char * temp = g_strconcat (path, ".tmp", NULL);
+   FILE * file = NULL;
+   if (g_mkdir_with_parents (dir, 0700) == 0)
+      file = fopen (temp, "w");
+   if (file) {
+      g_array_sort (rec->files, compare_files);
+      for (unsigned i = 0; i < rec->files->len; i ++)
+         fprintf (file, "%s\n", g_array_index (rec->files, file_t, i).path);
+      if (fclose (file) || rename (temp, path))
+         unlink (temp);
+   } else
+      warning ("cannot write readahead profile");
+   g_free (dir);
+   g_free (temp);
+}
+
+/* blocks for the whole recording, so call it in a process of its own as the
+ * session starts; each login refreshes the profile */
+void readahead_record (const char * user) {
+   char * path = profile_path (user);
+   if (! path)
+      return;
+   recording_t rec = {getpwnam (user)->pw_uid, g_hash_table_new_full
+    (g_str_hash, g_str_equal, free, NULL), g_array_new (false, false,
+    sizeof (file_t))};
+   for (int i = 0; i < SAMPLES; i ++) {
+      g_usleep (SAMPLE_INTERVAL * 1000);
+      sample (& rec);
+   }
+   save (& rec, path);
+   trace_mark ("readahead_recorded");
+   g_hash_table_destroy (rec.seen);
+   g_array_free (rec.files, true);
+   g_free (path);
+}
+
+/* runs in a process of its own, forked by the zygote alongside the login;
+ * the profile is read as root and the files as the user, so that nothing is
+ * opened that the user could not open anyway */
+void readahead_run (const char * user) {
+   char * path = profile_path (user);
+   char * list = NULL;
+   bool found = path && g_file_get_contents (path, & list, NULL, NULL);
+   g_free (path);
+   if (! found)
+      return;
+   trace_begin ("readahead");
+   drop_privileges (user);
+   for (char * name = list, * end; * name; name = end + 1) {
+      if (! (end = strchr (name, '\n')))
+         break;
+      * end = 0;
+      int handle = open (name, O_RDONLY | O_NONBLOCK | O_NOCTTY | O_CLOEXEC);
+      struct stat s;
+      if (handle < 0)
+         continue;
+      if (! fstat (handle, & s) && S_ISREG (s.st_mode))
+         readahead (handle, 0, s.st_size);
+      close (handle);
+   }
+   trace_end ("readahead");
+   g_free (list);
+}
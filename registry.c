@@ -0,0 +1,200 @@
+/*
+ * J-Login - registry.c
+ * Copyright 2019 John Lindgren
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions, and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions, and the following disclaimer in the documentation
+ *    provided with the distribution.
+ *
+ * This software is provided "as is" and without any warranty, express or
+ * implied. In no event shall the authors be liable for any damages arising from
+ * the use of this software.
+ */
+
+/* The consoles are written out whenever they change, so that a restarted or
+ * upgraded j-login can pick up the X servers and sessions left running by the
+ * last one.  Each process is recorded together with its start time, so that a
+ * reused pid is not mistaken for it.
+ *
+ * Each console has a line of its own, padded to RECORD_SIZE, which is
+ * rewritten in place when the console changes; a closed console's line is
+ * blanked and reused.  The file is rewritten whole (and compacted) only at
+ * startup and before a re-exec. */
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <glib.h>
+
+#include "config.h"
+#include "registry.h"
+#include "utils.h"
+
+#define RECORD_SIZE 512 /* a divisor of the page size, so no write straddles two */
+
+static int handle = -1; /* the file as last saved whole, for updates */
+static GArray * free_slots;
+static int slot_count;
+
+/* the start time in clock ticks since boot; 0 if there is no such process or
+ * it has already exited.  Callers keep it, so that saving does not have to
+ * read /proc for every console. */
+unsigned long long registry_start_time (pid_t process) {
+   if (process <= 0)
+      return 0;
+   SPRINTF (path, "/proc/%d/stat", (int) process);
+   int handle = open (path, O_RDONLY | O_CLOEXEC);
+   if (handle < 0)
+      return 0;
+   char buf[1024];
+   int length = read (handle, buf, sizeof buf - 1);
+   close (handle);
+   if (length <= 0)
+      return 0;
+   buf[length] = 0;
+   /* the command name may contain spaces, so count fields from its end */
+   const char * fields = strrchr (buf, ')');
+   char state;
+   unsigned long long start;
+   if (! fields || sscanf (fields + 1, " %c %*d %*d %*d %*d %*d %*u %*u %*u %*u "
+    "%*u %*u %*u %*d %*d %*d %*d %*d %*d %llu", & state, & start) != 2 ||
+    state == 'Z')
+      return 0;
+   return start;
+}
+
+static void format (char * buf, const record_t * r) {
+   int length = 0;
+   if (r)
+      length = snprintf (buf, RECORD_SIZE, "%d %d %d %llu %d %llu %d %s %d %llu "
+       "%d", r->vt, r->display, (int) r->x_process, r->x_start, (int)
+       r->process, r->start, r->locked, r->user[0] ? r->user : "-", (int)
+       r->greeter, r->greeter_start, r->greeter_handle);
+   memset (buf + length, ' ', RECORD_SIZE - 1 - length);
+   buf[RECORD_SIZE - 1] = '\n';
+}
+
+/* with records[i] in slot i */
+void registry_save (const record_t * records, int count) {
+   char * path = runtime_path (REGISTRY_FILE);
+   char * temp = runtime_path (REGISTRY_FILE ".tmp");
+   int new_handle = open (temp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+   bool ok = (new_handle >= 0);
+   char buf[RECORD_SIZE];
+   for (int i = 0; ok && i < count; i ++) {
+      format (buf, & records[i]);
+      ok = (write (new_handle, buf, RECORD_SIZE) == RECORD_SIZE);
+   }
+   if (ok)
+      ok = ! rename (temp, path);
+   g_free (path);
+   g_free (temp);
+   if (! ok) {
+      warning ("cannot write " REGISTRY_FILE);
+      if (new_handle >= 0)
+         close (new_handle);
+      return;
+   }
+   if (handle >= 0)
+      close (handle);
+   handle = new_handle;
+   if (! free_slots)
+      free_slots = g_array_new (false, false, sizeof (int));
+   g_array_set_size (free_slots, 0);
+   slot_count = count;
+}
+
+static void write_slot (int slot, const record_t * r) {
+   if (handle < 0 || slot < 0)
+      return;
+   char buf[RECORD_SIZE];
+   format (buf, r);
+   if (pwrite (handle, buf, RECORD_SIZE, (off_t) slot * RECORD_SIZE) !=
+    RECORD_SIZE)
+      warning ("cannot write " REGISTRY_FILE);
+}
+
+/* returns the console's slot; -1 before the first registry_save */
+int registry_add (const record_t * record) {
+   if (handle < 0)
+      return -1;
+   int slot;
+   if (free_slots->len) {
+      slot = g_array_index (free_slots, int, free_slots->len - 1);
+      g_array_set_size (free_slots, free_slots->len - 1);
+   } else
+      slot = slot_count ++;
+   write_slot (slot, record);
+   return slot;
+}
+
+void registry_update (int slot, const record_t * record) {
+   write_slot (slot, record);
+}
+
+void registry_remove (int slot) {
+   if (handle < 0 || slot < 0)
+      return;
+   write_slot (slot, NULL);
+   g_array_append_val (free_slots, slot);
+}
+
+/* returns only the consoles whose X server is still running; a session that
+ * has ended in the meantime leaves a plain greeter.  Lines written before the
+ * greeter was recorded are still read, as after an upgrade. */
+record_t * registry_load (int * count) {
+   * count = 0;
+   char * path = runtime_path (REGISTRY_FILE);
+   FILE * file = fopen (path, "r");
+   g_free (path);
+   if (! file)
+      return NULL;
+   int size = 0;
+   record_t * records = NULL;
+   record_t r;
+   int x_process, process, locked, greeter, fields;
+   char line[RECORD_SIZE + 1];
+   while (fgets (line, sizeof line, file)) {
+      greeter = r.greeter_handle = -1;
+      r.greeter_start = 0;
+      fields = sscanf (line, "%d %d %d %llu %d %llu %d %255s %d %llu %d", & r.vt,
+       & r.display, & x_process, & r.x_start, & process, & r.start, & locked,
+       r.user, & greeter, & r.greeter_start, & r.greeter_handle);
+      if ((fields != 8 && fields != 11) || ! r.x_start || registry_start_time
+       (x_process) != r.x_start)
+         continue;
+      r.x_process = x_process;
+      r.process = process;
+      r.locked = locked;
+      r.greeter = greeter;
+      if (! r.greeter_start || registry_start_time (greeter) !=
+       r.greeter_start) {
+         r.greeter = r.greeter_handle = -1;
+         r.greeter_start = 0;
+      }
+      if (! r.start || registry_start_time (process) != r.start || ! strcmp
+       (r.user, "-")) {
+         r.process = -1;
+         r.start = 0;
+         r.locked = false;
+         r.user[0] = 0;
+      }
+      if (* count == size) {
+         size = size ? size * 2 : 4;
+         if (! (records = realloc (records, sizeof (record_t) * size)))
+            fail ("realloc");
+      }
+      records[(* count) ++] = r;
+   }
+   fclose (file);
+   return records;
+}
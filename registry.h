@@ -0,0 +1,46 @@
+/*
+ * J-Login - registry.h
+ * Copyright 2019 John Lindgren
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions, and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions, and the following disclaimer in the documentation
+ *    provided with the distribution.
+ *
+ * This software is provided "as is" and without any warranty, express or
+ * implied. In no event shall the authors be liable for any damages arising from
+ * the use of this software.
+ */
+
+#ifndef JLOGIN_REGISTRY_H
+#define JLOGIN_REGISTRY_H
+
+#include <stdbool.h>
+#include <sys/types.h>
+
+#define REGISTRY_FILE "j-login.consoles" /* in RuntimeDir */
+
+typedef struct {
+   int vt, display;
+   pid_t x_process, process; /* process is -1 if there is no session */
+   unsigned long long x_start, start; /* from registry_start_time */
+   bool locked;
+   char user[256];
+   pid_t greeter; /* -1 if there is none */
+   unsigned long long greeter_start;
+   int greeter_handle; /* -1 except when handed over by a re-exec */
+} record_t;
+
+unsigned long long registry_start_time (pid_t process);
+void registry_save (const record_t * records, int count);
+int registry_add (const record_t * record);
+void registry_update (int slot, const record_t * record);
+void registry_remove (int slot);
+record_t * registry_load (int * count); /* free with free */
+
+#endif
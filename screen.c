@@ -17,66 +17,429 @@
  * the use of this software.
  */
 
+#include <errno.h>
 #include <fcntl.h>
 #include <linux/vt.h>
+#include <signal.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <sys/ioctl.h>
 #include <time.h>
 #include <unistd.h>
 
+#include <glib-unix.h>
 #include <X11/extensions/scrnsaver.h>
 
+#include "config.h"
+#include "metrics.h"
 #include "screen.h"
+#include "trace.h"
 #include "utils.h"
 
+#define ACTIVE_FILE "/sys/class/tty/tty0/active"
+#define SWITCH_POLL 10
+
+/* Start, readiness and stop are the same for every X server (-displayfd and
+ * SIGTERM); what differs is the command line and what a VT is.  Only the "vt"
+ * backend touches real VTs; the others number their displays like VTs and
+ * keep track of which one is "active" themselves, so that j-login can run
+ * unprivileged with no console (Xvfb) or inside another X session (Xephyr). */
+typedef struct {
+   const char * name, * server;
+   void (* init) (void);
+   void (* add_args) (GPtrArray * args, int vt, bool spare);
+   void (* activate) (int vt); /* calls finish_switch unless it is pending */
+   int (* active) (void);
+} backend_t;
+
+typedef struct {
+   int vt;
+   vt_cb callback;
+   void * data;
+   int64_t start;
+   unsigned watch_source, timeout_source;
+} switch_t;
+
+static const backend_t * backend;
 static int vt_handle;
-static int next_vt = 7;
+static int active_handle = -1;
+static int virtual_vt;
+static switch_t * pending_switch;
 
-void init_vt (void) {
+/* ids given back are handed out again before new ones, from a stack, so that
+ * taking and giving back an id are both O(1) however many are in use */
+typedef struct {
+   int next;
+   GArray * free;
+} pool_t;
+
+static pool_t vt_pool, display_pool;
+
+static int pool_take (pool_t * pool, int min) {
+   while (pool->free->len) {
+      int id = g_array_index (pool->free, int, pool->free->len - 1);
+      g_array_set_size (pool->free, pool->free->len - 1);
+      if (id >= min)
+         return id;
+   }
+   pool->next = MAX (pool->next, min);
+   return pool->next ++;
+}
+
+static void pool_give (pool_t * pool, int id) {
+   g_array_append_val (pool->free, id);
+}
+
+/* not O(1), but only done at startup */
+static void pool_reserve (pool_t * pool, int id, int min) {
+   pool->next = MAX (pool->next, min);
+   while (pool->next <= id)
+      pool_give (pool, pool->next ++);
+   for (unsigned i = 0; i < pool->free->len; i ++) {
+      if (g_array_index (pool->free, int, i) == id) {
+         g_array_remove_index_fast (pool->free, i);
+         break;
+      }
+   }
+}
+
+static void finish_switch (bool switched) {
+   switch_t * sw = pending_switch;
+   pending_switch = NULL;
+   if (sw->watch_source)
+      g_source_remove (sw->watch_source);
+   if (sw->timeout_source)
+      g_source_remove (sw->timeout_source);
+   if (switched)
+      metrics_observe (HIST_VT_SWITCH, sw->start);
+   trace_mark (switched ? "vt_switched" : "vt_not_switched");
+   if (sw->callback)
+      sw->callback (switched, sw->data);
+   free (sw);
+}
+
+static void vt_init (void) {
    if ((vt_handle = open ("/dev/console", O_RDONLY)) < 0)
       fail2 ("open", "/dev/console");
    if (fcntl (vt_handle, F_SETFD, FD_CLOEXEC) < 0)
       fail2 ("FD_CLOEXEC", "/dev/console");
+   /* without it, set_vt falls back to polling VT_GETSTATE */
+   if ((active_handle = open (ACTIVE_FILE, O_RDONLY | O_CLOEXEC)) < 0)
+      warning ("cannot watch " ACTIVE_FILE);
+}
+
+/* X still switches to its VT as it starts (j-login switches back once it is
+ * ready), but a spare must not switch to the VT it started from when it is
+ * stopped, since that is no longer where the user is */
+static void vt_add_args (GPtrArray * args, int vt, bool spare) {
+   g_ptr_array_add (args, g_strdup_printf ("vt%d", vt));
+   if (spare)
+      g_ptr_array_add (args, g_strdup ("-novtswitch"));
 }
 
-void set_vt (int vt) {
+/* sysfs only signals a change to someone who has read the file since the
+ * last one, so this also rearms the watch */
+static int read_active (void) {
+   char buf[16];
+   int length = pread (active_handle, buf, sizeof buf - 1, 0);
+   if (length < 0)
+      fail2 ("read", ACTIVE_FILE);
+   buf[length] = 0;
+   return strncmp (buf, "tty", 3) ? -1 : atoi (buf + 3);
+}
+
+static int vt_active (void) {
+   if (active_handle >= 0)
+      return read_active ();
+   struct vt_stat state;
+   if (ioctl (vt_handle, VT_GETSTATE, & state) < 0)
+      fail ("VT_GETSTATE");
+   return state.v_active;
+}
+
+static int active_cb (int fd, GIOCondition condition, void * unused) {
+   (void) fd;
+   (void) condition;
+   (void) unused;
+   if (read_active () == pending_switch->vt) {
+      pending_switch->watch_source = 0;
+      finish_switch (true);
+      return G_SOURCE_REMOVE;
+   }
+   return G_SOURCE_CONTINUE;
+}
+
+static int poll_cb (void * unused) {
+   (void) unused;
+   if (vt_active () == pending_switch->vt) {
+      pending_switch->watch_source = 0;
+      finish_switch (true);
+      return G_SOURCE_REMOVE;
+   }
+   return G_SOURCE_CONTINUE;
+}
+
+static void vt_activate (int vt) {
    if (ioctl (vt_handle, VT_ACTIVATE, vt) < 0)
       fail ("VT_ACTIVATE");
-   if (ioctl (vt_handle, VT_WAITACTIVE, vt) < 0)
-      fail ("VT_WAITACTIVE");
+   if (active_handle >= 0)
+      pending_switch->watch_source = g_unix_fd_add (active_handle, G_IO_PRI |
+       G_IO_ERR, active_cb, NULL);
+   else
+      pending_switch->watch_source = g_timeout_add (SWITCH_POLL, poll_cb, NULL);
+}
+
+static void virtual_init (void) {
+}
+
+static void xvfb_add_args (GPtrArray * args, int vt, bool spare) {
+   g_ptr_array_add (args, g_strdup ("-screen"));
+   g_ptr_array_add (args, g_strdup ("0"));
+   g_ptr_array_add (args, g_strdup_printf ("%sx24", config->geometry));
+   /* as a real X server switches to its VT as it starts, unless a spare */
+   if (! spare)
+      virtual_vt = vt;
+}
+
+/* viewers connect through a socket only root can open, by way of whatever
+ * proxy provides the transport and its security */
+static void xvnc_add_args (GPtrArray * args, int vt, bool spare) {
+   g_ptr_array_add (args, g_strdup ("-geometry"));
+   g_ptr_array_add (args, g_strdup (config->geometry));
+   g_ptr_array_add (args, g_strdup ("-rfbport"));
+   g_ptr_array_add (args, g_strdup ("-1"));
+   g_ptr_array_add (args, g_strdup ("-rfbunixpath"));
+   SPRINTF (name, "j-login-vnc-%d", vt);
+   g_ptr_array_add (args, runtime_path (name));
+   g_ptr_array_add (args, g_strdup ("-rfbunixmode"));
+   g_ptr_array_add (args, g_strdup ("0600"));
+   g_ptr_array_add (args, g_strdup ("-SecurityTypes"));
+   g_ptr_array_add (args, g_strdup ("None"));
+   if (! spare)
+      virtual_vt = vt;
+}
+
+static void xephyr_add_args (GPtrArray * args, int vt, bool spare) {
+   g_ptr_array_add (args, g_strdup ("-screen"));
+   g_ptr_array_add (args, g_strdup (config->geometry));
+   g_ptr_array_add (args, g_strdup ("-title"));
+   g_ptr_array_add (args, g_strdup_printf ("J-Login vt%d", vt));
+   if (! spare)
+      virtual_vt = vt;
+}
+
+static void virtual_activate (int vt) {
+   virtual_vt = vt;
+   finish_switch (true);
+}
+
+static int virtual_active (void) {
+   return virtual_vt;
+}
+
+static const backend_t backends[] = {
+   {"vt", "X", vt_init, vt_add_args, vt_activate, vt_active},
+   {"xvfb", "Xvfb", virtual_init, xvfb_add_args, virtual_activate, virtual_active},
+   {"xvnc", "Xvnc", virtual_init, xvnc_add_args, virtual_activate, virtual_active},
+   {"xephyr", "Xephyr", virtual_init, xephyr_add_args, virtual_activate, virtual_active}
+};
+
+void init_vt (void) {
+   for (int i = 0; i < (int) G_N_ELEMENTS (backends); i ++) {
+      if (! strcmp (backends[i].name, config->backend))
+         backend = & backends[i];
+   }
+   if (! backend)
+      error ("unknown display backend");
+   vt_pool.free = g_array_new (false, false, sizeof (int));
+   display_pool.free = g_array_new (false, false, sizeof (int));
+   backend->init ();
+}
+
+static int switch_timeout_cb (void * unused) {
+   (void) unused;
+   pending_switch->timeout_source = 0;
+   warning ("VT switch timed out");
+   finish_switch (get_vt () == pending_switch->vt);
+   return G_SOURCE_REMOVE;
 }
 
-static int get_open_display (void) {
-   for (int display = 0; display < 100; display ++) {
-      SPRINTF (path, "/tmp/.X%d-lock", display);
-      if (! exist (path))
-         return display;
+/* returns at once rather than waiting in VT_WAITACTIVE, since the switch waits
+ * on the X server of the outgoing VT, which may be slow to give up the GPU;
+ * callback (which may be NULL) runs once the switch is seen or has timed out.
+ * A newer switch supersedes one still pending. */
+void set_vt (int vt, vt_cb callback, void * data) {
+   if (pending_switch)
+      finish_switch (false);
+   trace_mark ("vt_switch");
+   NEW (switch_t, sw, vt, callback, data, metrics_now (), 0, 0);
+   pending_switch = sw;
+   if (backend->active () == vt) {
+      finish_switch (true);
+      return;
    }
-   error ("no available display");
-   return -1;
+   backend->activate (vt);
+   if (pending_switch == sw)
+      sw->timeout_source = g_timeout_add (config->switch_timeout,
+       switch_timeout_cb, NULL);
+}
+
+int get_vt (void) {
+   return backend->active ();
 }
 
-void start_x (int * vt, int * display) {
-   * vt = next_vt ++;
-   * display = get_open_display ();
-   SPRINTF (display_opt, ":%d", * display);
-   SPRINTF (vt_opt, "vt%d", * vt);
-   launch ((const char * []){"X", display_opt, vt_opt, NULL});
-   SPRINTF (path, "/tmp/.X11-unix/X%d", * display);
-   wait_for_exist ("/tmp", "/tmp/.X11-unix");
-   wait_for_exist ("/tmp/.X11-unix", path);
+/* false if the "VTs" are only numbers given to virtual displays */
+bool has_vts (void) {
+   return backend->init == vt_init;
 }
 
-void ssaver_init (Display * display) {
+/* X writes the display number to the -displayfd pipe once it is ready to
+ * accept connections, so there is no need to poll for the socket; -1 if it
+ * exits first */
+static int read_display (int handle) {
+   char buf[16];
+   int length = 0;
+   while (length < (int) sizeof buf - 1 && ! memchr (buf, '\n', length)) {
+      int got = read (handle, buf + length, sizeof buf - 1 - length);
+      if (got < 0 && errno == EINTR)
+         continue;
+      if (got < 0) {
+         warning ("cannot read -displayfd");
+         return -1;
+      }
+      if (! got)
+         break;
+      length += got;
+   }
+   if (! length)
+      return -1;
+   buf[length] = 0;
+   return atoi (buf);
+}
+
+/* a display is in use if its lock file names a running process; X leaves the
+ * lock file behind if it is killed, and such a stale one is removed here */
+static bool display_in_use (int display) {
+   SPRINTF (lock, "/tmp/.X%d-lock", display);
+   int handle = open (lock, O_RDONLY | O_CLOEXEC);
+   if (handle < 0)
+      return errno != ENOENT;
+   char buf[16];
+   int length = read (handle, buf, sizeof buf - 1);
+   close (handle);
+   buf[MAX (length, 0)] = 0;
+   pid_t process = atoi (buf);
+   if (process > 0 && (! kill (process, 0) || errno == EPERM))
+      return true;
+   SPRINTF (socket, "/tmp/.X11-unix/X%d", display);
+   unlink (socket);
+   return unlink (lock) < 0 && errno != ENOENT;
+}
+
+/* a display held by some other X server is dropped from the pool for good */
+static int alloc_display (void) {
+   int display;
+   while (display_in_use (display = pool_take (& display_pool,
+    config->first_display))) {}
+   return display;
+}
+
+typedef struct {
+   int display;
+   int64_t start;
+   x_ready_cb callback;
+} starting_t;
+
+static int ready_cb (int handle, GIOCondition condition, void * data) {
+   (void) condition;
+   starting_t * starting = data;
+   int display = read_display (handle);
+   close (handle);
+   bool ready = (display == starting->display);
+   if (display >= 0 && ! ready)
+      warning ("X server reported the wrong display");
+   trace_mark (ready ? "x_ready" : "x_failed");
+   if (ready)
+      metrics_observe (HIST_START_X, starting->start);
+   starting->callback (starting->display, ready);
+   free (starting);
+   return G_SOURCE_REMOVE;
+}
+
+/* returns as soon as X is launched, so that the caller can get on with
+ * everything that does not need the display; callback is called from the
+ * main loop once X accepts connections, or has failed to start.  -1 if X
+ * cannot be launched at all. */
+pid_t start_x (int * vt, int * display, bool spare, x_ready_cb callback) {
+   int64_t start = metrics_now ();
+   * vt = pool_take (& vt_pool, config->first_vt);
+   * display = alloc_display ();
+   int fds[2];
+   if (pipe2 (fds, O_CLOEXEC) < 0)
+      fail ("pipe2");
+   if (fcntl (fds[1], F_SETFD, 0) < 0)
+      fail2 ("fcntl", "displayfd");
+   GPtrArray * args = g_ptr_array_new_with_free_func (g_free);
+   g_ptr_array_add (args, g_strdup (backend->server));
+   g_ptr_array_add (args, g_strdup_printf (":%d", * display));
+   g_ptr_array_add (args, g_strdup ("-displayfd"));
+   g_ptr_array_add (args, g_strdup_printf ("%d", fds[1]));
+   backend->add_args (args, * vt, spare);
+   for (char * * arg = config->x_args; * arg; arg ++)
+      g_ptr_array_add (args, g_strdup (* arg));
+   g_ptr_array_add (args, NULL);
+   pid_t process = launch ((const char * const *) args->pdata);
+   g_ptr_array_free (args, true);
+   close (fds[1]);
+   if (process < 0) {
+      close (fds[0]);
+      free_console (* vt, * display);
+      return -1;
+   }
+   trace_mark ("x_launched");
+   NEW (starting_t, starting, * display, start, callback);
+   g_unix_fd_add (fds[0], G_IO_IN | G_IO_HUP | G_IO_ERR, ready_cb, starting);
+   return process;
+}
+
+/* one that has already gone is left to its exit watch */
+void stop_x (pid_t process) {
+   if (kill (process, SIGTERM) && errno != ESRCH)
+      fail ("kill");
+}
+
+/* called once the X server has exited */
+void free_console (int vt, int display) {
+   pool_give (& vt_pool, vt);
+   pool_give (& display_pool, display);
+}
+
+/* takes the VT and display of an X server from before a restart */
+void reserve_console (int vt, int display) {
+   pool_reserve (& vt_pool, vt, config->first_vt);
+   pool_reserve (& display_pool, display, config->first_display);
+}
+
+/* returns the event base for ssaver_is_notify */
+int ssaver_init (Display * display) {
    int event_base, error_base;
    if (! XScreenSaverQueryExtension (display, & event_base, & error_base))
       fail ("XScreenSaverQueryExtension");
+   XScreenSaverSelectInput (display, DefaultRootWindow (display),
+    ScreenSaverNotifyMask);
+   return event_base;
+}
+
+bool ssaver_is_notify (int event_base, const XEvent * event) {
+   return event->type == event_base + ScreenSaverNotify;
 }
 
+/* returns -1 if the screensaver is not active */
 int ssaver_active_ms (Display * display) {
    XScreenSaverInfo info;
    if (! XScreenSaverQueryInfo (display, DefaultRootWindow (display), & info))
-      fail ("XScreenSaverQueryInfo");
-   return info.state == ScreenSaverOff ? -info.til_or_since : info.til_or_since;
+      return -1; /* the connection is broken */
+   return info.state == ScreenSaverOn ? (int) info.til_or_since : -1;
 }
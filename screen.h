@@ -20,14 +20,25 @@
 #ifndef JLOGIN_SCREEN_H
 #define JLOGIN_SCREEN_H
 
+#include <stdbool.h>
+#include <sys/types.h>
 #include <X11/Xlib.h>
 
 void init_vt (void);
-void set_vt (int vt);
+typedef void (* vt_cb) (bool switched, void * data);
+typedef void (* x_ready_cb) (int display, bool ready);
 
-void start_x (int * display, int * vt);
+void set_vt (int vt, vt_cb callback, void * data);
+int get_vt (void);
+bool has_vts (void);
 
-void ssaver_init (Display * display);
+pid_t start_x (int * vt, int * display, bool spare, x_ready_cb callback);
+void stop_x (pid_t process);
+void free_console (int vt, int display);
+void reserve_console (int vt, int display);
+
+int ssaver_init (Display * display);
+bool ssaver_is_notify (int event_base, const XEvent * event);
 int ssaver_active_ms (Display * display);
 
 #endif
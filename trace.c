@@ -0,0 +1,129 @@
+/*
+ * J-Login - trace.c
+ * Copyright 2019 John Lindgren
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions, and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions, and the following disclaimer in the documentation
+ *    provided with the distribution.
+ *
+ * This software is provided "as is" and without any warranty, express or
+ * implied. In no event shall the authors be liable for any damages arising from
+ * the use of this software.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <glib.h>
+
+#include "config.h"
+#include "trace.h"
+#include "utils.h"
+
+#define TRACE_FILE "j-login-trace.json" /* in RuntimeDir */
+#define TRACE_SIZE 4096
+
+typedef struct {
+   const char * name;
+   char phase;
+   pid_t pid, tid;
+   int64_t usec;
+} event_t;
+
+typedef struct {
+   unsigned next;
+   event_t events[TRACE_SIZE];
+} ring_t;
+
+/* shared, so that forked children (PAM, session launch) record into it too */
+static ring_t * ring;
+static pid_t owner;
+static trace_cb forward;
+
+static void dump_at_exit (void) {
+   if (getpid () == owner)
+      trace_dump ();
+}
+
+void trace_init (void) {
+   ring = mmap (NULL, sizeof (ring_t), PROT_READ | PROT_WRITE, MAP_SHARED |
+    MAP_ANONYMOUS, -1, 0);
+   if (ring == MAP_FAILED)
+      fail ("mmap");
+   owner = getpid ();
+   atexit (dump_at_exit);
+}
+
+/* for j-login-greeter, which has no ring of its own; its events go to
+ * j-login, where they end up in the same dump */
+void trace_forward (trace_cb callback) {
+   forward = callback;
+}
+
+void trace_insert (const char * name, char phase, pid_t pid, pid_t tid,
+ int64_t usec) {
+   if (! ring)
+      return;
+   unsigned index = __atomic_fetch_add (& ring->next, 1, __ATOMIC_RELAXED);
+   ring->events[index % TRACE_SIZE] = (event_t) {name, phase, pid, tid, usec};
+}
+
+static void record (const char * name, char phase) {
+   struct timespec now;
+   clock_gettime (CLOCK_MONOTONIC, & now);
+   int64_t usec = (int64_t) now.tv_sec * 1000000 + now.tv_nsec / 1000;
+   if (forward)
+      forward (name, phase, usec);
+   else
+      trace_insert (name, phase, getpid (), gettid (), usec);
+}
+
+void trace_begin (const char * name) {
+   record (name, 'B');
+}
+
+void trace_end (const char * name) {
+   record (name, 'E');
+}
+
+void trace_mark (const char * name) {
+   record (name, 'i');
+}
+
+static void write_events (FILE * file) {
+   unsigned next = __atomic_load_n (& ring->next, __ATOMIC_RELAXED);
+   unsigned first = next > TRACE_SIZE ? next - TRACE_SIZE : 0;
+   fprintf (file, "{\"traceEvents\":[");
+   for (unsigned i = first; i < next; i ++) {
+      const event_t * event = & ring->events[i % TRACE_SIZE];
+      fprintf (file, "%s\n{\"name\":\"%s\",\"ph\":\"%c\",\"ts\":%lld,"
+       "\"pid\":%d,\"tid\":%d%s}", i > first ? "," : "", event->name,
+       event->phase, (long long) event->usec, (int) event->pid,
+       (int) event->tid, event->phase == 'i' ? ",\"s\":\"p\"" : "");
+   }
+   fprintf (file, "\n]}\n");
+}
+
+/* writes the buffered events in Chrome trace event format */
+void trace_dump (void) {
+   char * path = runtime_path (TRACE_FILE);
+   char * temp = runtime_path (TRACE_FILE ".tmp");
+   FILE * file = fopen (temp, "w");
+   if (file) {
+      write_events (file);
+      if (fclose (file) || rename (temp, path))
+         unlink (temp);
+   }
+   g_free (path);
+   g_free (temp);
+}
@@ -0,0 +1,38 @@
+/*
+ * J-Login - trace.h
+ * Copyright 2019 John Lindgren
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions, and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions, and the following disclaimer in the documentation
+ *    provided with the distribution.
+ *
+ * This software is provided "as is" and without any warranty, express or
+ * implied. In no event shall the authors be liable for any damages arising from
+ * the use of this software.
+ */
+
+#ifndef JLOGIN_TRACE_H
+#define JLOGIN_TRACE_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+typedef void (* trace_cb) (const char * name, char phase, int64_t usec);
+
+/* names must be string literals, since only the pointer is recorded */
+void trace_init (void);
+void trace_forward (trace_cb callback); /* instead of trace_init */
+void trace_insert (const char * name, char phase, pid_t pid, pid_t tid,
+ int64_t usec); /* name must last as long as the process */
+void trace_begin (const char * name);
+void trace_end (const char * name);
+void trace_mark (const char * name);
+void trace_dump (void);
+
+#endif
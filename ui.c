@@ -24,16 +24,33 @@
 #include <X11/Xlib.h>
 
 #include "actions.h"
+#include "config.h"
+#include "trace.h"
 #include "ui.h"
 #include "utils.h"
 
+/* trace events are forwarded to j-login, which keeps only the names listed
+ * in greeter.c */
+
 struct ui_s {
    GtkWidget * window, * fixed, * frame, * pages, * log_in_page, * fail_page;
+   GtkWidget * prompt;
    GtkWidget * name_entry, * password_entry, * log_in_button, * back_button;
    GtkWidget * status_bar, * sleep_button, * shut_down_button, * reboot_button;
    GList * extra_windows;
+   bool shown;
+   bool keyboard, mouse;
+   int grab_tries;
+   unsigned grab_source;
+   GList * waiters;
 };
 
+#define ICON_FILE "/usr/share/pixmaps/j-login.png"
+#define BACKGROUND_KEY "j-login-background"
+
+/* decoded once and shared by every window */
+static GdkPixbuf * icon, * background;
+
 /* override GTK symbol so that GTK never releases our grab */
 GdkGrabStatus gdk_pointer_grab (GdkWindow * window, gboolean owner_events,
  GdkEventMask event_mask, GdkWindow * confine_to, GdkCursor * cursor,
@@ -65,27 +82,27 @@ void gdk_keyboard_ungrab (guint32 time) {
    (void) time;
 }
 
-static void unblock_x (Display * handle) {
-   XUngrabPointer (handle, CurrentTime);
-   XUngrabKeyboard (handle, CurrentTime);
-}
-
-static bool block_x (Display * handle, Window window) {
-   bool mouse = false, keyboard = false;
-   for (int count = 0; count < 50; count ++) {
-      if (! keyboard)
-         keyboard = (XGrabKeyboard (handle, window, true, GrabModeAsync,
-          GrabModeAsync, CurrentTime) == GrabSuccess);
-      if (! mouse)
-         mouse = (XGrabPointer (handle, window, true, 0, GrabModeAsync,
-          GrabModeAsync, window, None, CurrentTime) == GrabSuccess);
-      if (keyboard && mouse)
-         return true;
-      struct timespec delay = {.tv_sec = 0, .tv_nsec = 20000000};
-      nanosleep (& delay, 0);
-   }
-   unblock_x (handle);
-   return false;
+static void unblock_x (ui_t * ui) {
+   GdkWindow * gdkw = gtk_widget_get_window (ui->window);
+   XUngrabPointer (GDK_WINDOW_XDISPLAY (gdkw), CurrentTime);
+   XUngrabKeyboard (GDK_WINDOW_XDISPLAY (gdkw), CurrentTime);
+   ui->keyboard = ui->mouse = false;
+}
+
+/* makes one attempt at each grab not yet held */
+static bool block_x (ui_t * ui) {
+   trace_begin ("block_x");
+   GdkWindow * gdkw = gtk_widget_get_window (ui->window);
+   Display * handle = GDK_WINDOW_XDISPLAY (gdkw);
+   Window window = GDK_WINDOW_XID (gdkw);
+   if (! ui->keyboard)
+      ui->keyboard = (XGrabKeyboard (handle, window, true, GrabModeAsync,
+       GrabModeAsync, CurrentTime) == GrabSuccess);
+   if (! ui->mouse)
+      ui->mouse = (XGrabPointer (handle, window, true, 0, GrabModeAsync,
+       GrabModeAsync, window, None, CurrentTime) == GrabSuccess);
+   trace_end ("block_x");
+   return ui->keyboard && ui->mouse;
 }
 
 static void set_override_redirect (GtkWidget * window) {
@@ -93,11 +110,86 @@ static void set_override_redirect (GtkWidget * window) {
    gdk_window_set_override_redirect (gdkw, true);
 }
 
+static GdkPixbuf * get_icon (void) {
+   if (! icon)
+      icon = gdk_pixbuf_new_from_file (ICON_FILE, NULL);
+   return icon;
+}
+
+static void drop_background (GdkScreen * screen) {
+   g_object_set_data ((GObject *) screen, BACKGROUND_KEY, NULL);
+}
+
+static void draw_monitor (GdkPixmap * pixmap, GdkGC * gc, GdkRectangle * rect) {
+   int bw = gdk_pixbuf_get_width (background);
+   int bh = gdk_pixbuf_get_height (background);
+   /* scale to cover the monitor, cropping the overflow evenly */
+   double scale = MAX ((double) rect->width / bw, (double) rect->height / bh);
+   int sw = MAX ((int) (bw * scale + 0.5), rect->width);
+   int sh = MAX ((int) (bh * scale + 0.5), rect->height);
+   GdkPixbuf * scaled = gdk_pixbuf_scale_simple (background, sw, sh,
+    GDK_INTERP_BILINEAR);
+   if (! scaled)
+      return;
+   gdk_draw_pixbuf ((GdkDrawable *) pixmap, gc, scaled, (sw - rect->width) / 2,
+    (sh - rect->height) / 2, rect->x, rect->y, rect->width, rect->height,
+    GDK_RGB_DITHER_NONE, 0, 0);
+   g_object_unref (scaled);
+}
+
+/* rendered once per screen and kept until the screen geometry changes */
+static GdkPixmap * get_background (GdkScreen * screen, GdkWindow * gdkw) {
+   GdkPixmap * pixmap = g_object_get_data ((GObject *) screen, BACKGROUND_KEY);
+   if (pixmap || ! background)
+      return pixmap;
+   int w = gdk_screen_get_width (screen), h = gdk_screen_get_height (screen);
+   pixmap = gdk_pixmap_new ((GdkDrawable *) gdkw, w, h, -1);
+   GdkGC * gc = gdk_gc_new ((GdkDrawable *) pixmap);
+   GdkColor black = {0, 0, 0, 0};
+   gdk_gc_set_rgb_fg_color (gc, & black);
+   gdk_draw_rectangle ((GdkDrawable *) pixmap, gc, true, 0, 0, w, h);
+   int n_monitors = gdk_screen_get_n_monitors (screen);
+   for (int m = 0; m < n_monitors; m ++) {
+      GdkRectangle rect;
+      gdk_screen_get_monitor_geometry (screen, m, & rect);
+      draw_monitor (pixmap, gc, & rect);
+   }
+   g_object_unref (gc);
+   if (! g_object_get_data ((GObject *) screen, BACKGROUND_KEY "-watched")) {
+      g_object_set_data ((GObject *) screen, BACKGROUND_KEY "-watched", screen);
+      g_signal_connect (screen, "monitors-changed", (GCallback) drop_background, NULL);
+      g_signal_connect (screen, "size-changed", (GCallback) drop_background, NULL);
+   }
+   g_object_set_data_full ((GObject *) screen, BACKGROUND_KEY, pixmap, g_object_unref);
+   return pixmap;
+}
+
+/* the X server paints the background, so exposes need no redraw from us */
+static void apply_background (GtkWidget * window) {
+   GdkWindow * gdkw = gtk_widget_get_window (window);
+   if (! gdkw)
+      return;
+   GdkPixmap * pixmap = get_background (gtk_widget_get_screen (window), gdkw);
+   if (pixmap)
+      gdk_window_set_back_pixmap (gdkw, pixmap, false);
+   else /* the background may have been removed since */
+      gtk_style_set_background (gtk_widget_get_style (window), gdkw, GTK_STATE_NORMAL);
+   gdk_window_clear (gdkw);
+}
+
 static GtkWidget * make_window_for_screen (GdkScreen * screen) {
    GtkWidget * window = gtk_window_new (GTK_WINDOW_TOPLEVEL);
    gtk_window_set_screen ((GtkWindow *) window, screen);
    gtk_window_set_keep_above ((GtkWindow *) window, true);
+   gtk_widget_set_app_paintable (window, true);
    g_signal_connect (window, "realize", (GCallback) set_override_redirect, NULL);
+   g_signal_connect_data (window, "realize", (GCallback) apply_background,
+    NULL, NULL, G_CONNECT_AFTER);
+   /* after drop_background, which is connected first */
+   g_signal_connect_object (screen, "monitors-changed", (GCallback)
+    apply_background, window, G_CONNECT_SWAPPED | G_CONNECT_AFTER);
+   g_signal_connect_object (screen, "size-changed", (GCallback)
+    apply_background, window, G_CONNECT_SWAPPED | G_CONNECT_AFTER);
    return window;
 }
 
@@ -111,9 +203,11 @@ static void make_window (ui_t * ui, GdkDisplay * display) {
    GdkScreen * screen = gdk_display_get_default_screen (display);
    ui->window = make_window_for_screen (screen);
    ui->fixed = gtk_fixed_new ();
+   /* let the window background show through */
+   gtk_widget_set_has_window (ui->fixed, false);
    ui->frame = gtk_vbox_new (false, 6);
-   GtkWidget * icon = gtk_image_new_from_file ("/usr/share/pixmaps/j-login.png");
-   gtk_box_pack_start ((GtkBox *) ui->frame, icon, false, false, 0);
+   GtkWidget * image = gtk_image_new_from_pixbuf (get_icon ());
+   gtk_box_pack_start ((GtkBox *) ui->frame, image, false, false, 0);
    ui->pages = gtk_hbox_new (false, 6);
    gtk_box_pack_start ((GtkBox *) ui->frame, ui->pages, true, false, 0);
    gtk_fixed_put ((GtkFixed *) ui->fixed, ui->frame, 0, 0);
@@ -140,8 +234,8 @@ static void make_log_in_page (ui_t * ui) {
    ui->log_in_page = gtk_vbox_new (false, 6);
    gtk_box_pack_start ((GtkBox *) ui->pages, ui->log_in_page, true, false, 0);
    GtkWidget * prompt_box = gtk_hbox_new (false, 6);
-   GtkWidget * prompt = gtk_label_new ("Name and password:");
-   gtk_box_pack_start ((GtkBox *) prompt_box, prompt, false, false, 0);
+   ui->prompt = gtk_label_new ("Name and password:");
+   gtk_box_pack_start ((GtkBox *) prompt_box, ui->prompt, false, false, 0);
    gtk_box_pack_start ((GtkBox *) ui->log_in_page, prompt_box, false, false, 0);
    ui->name_entry = gtk_entry_new ();
    gtk_box_pack_start ((GtkBox *) ui->log_in_page, ui->name_entry, false, false, 0);
@@ -217,18 +311,31 @@ static void screen_changed (ui_t * ui) {
       do_layout (ui);
 }
 
-static void attempt_login (ui_t * ui) {
-   char * name = my_strdup (gtk_entry_get_text ((GtkEntry *) ui->name_entry));
-   char * password = my_strdup (gtk_entry_get_text ((GtkEntry *) ui->password_entry));
+static void set_checking (ui_t * ui, bool checking) {
+   gtk_label_set_text ((GtkLabel *) ui->prompt, checking ? "Checking ..." :
+    "Name and password:");
+   gtk_widget_set_sensitive (ui->name_entry, ! checking);
+   gtk_widget_set_sensitive (ui->password_entry, ! checking);
+   gtk_widget_set_sensitive (ui->log_in_button, ! checking);
+}
+
+static void login_done (bool success, void * data) {
+   ui_t * ui = data;
+   set_checking (ui, false);
    reset (ui);
-   if (! log_in (name, password)) {
+   if (! success) {
       gtk_widget_hide (ui->log_in_page);
       gtk_widget_show (ui->fail_page);
       gtk_widget_grab_focus (ui->back_button);
       gtk_widget_grab_default (ui->back_button);
    }
-   free (name);
-   free (password);
+}
+
+static void attempt_login (ui_t * ui) {
+   const char * name = gtk_entry_get_text ((GtkEntry *) ui->name_entry);
+   const char * password = gtk_entry_get_text ((GtkEntry *) ui->password_entry);
+   set_checking (ui, true);
+   log_in (name, password, login_done, ui);
 }
 
 static void set_up_window (ui_t * ui) {
@@ -251,36 +358,128 @@ static void show_windows (ui_t * ui) {
    gtk_window_present ((GtkWindow *) ui->window);
 }
 
-ui_t * ui_create (GdkDisplay * display, const char * status, bool can_quit) {
+static void hide_windows (ui_t * ui) {
+   for (GList * node = ui->extra_windows; node; node = node->next)
+      gtk_widget_hide ((GtkWidget *) node->data);
+   gtk_widget_hide (ui->window);
+}
+
+/* decodes what needs no display, e.g. while X is still starting */
+void ui_preload (void) {
+   get_icon ();
+}
+
+/* existing UIs keep the old background until ui_redraw_background */
+void ui_set_background (const char * file) {
+   if (background) {
+      g_object_unref (background);
+      background = NULL;
+   }
+   if (! file)
+      return;
+   GError * error = NULL;
+   background = gdk_pixbuf_new_from_file (file, & error);
+   if (error) {
+      warning (error->message);
+      g_error_free (error);
+   }
+}
+
+/* picks up a background set since the UI was created */
+void ui_redraw_background (ui_t * ui) {
+   drop_background (gtk_widget_get_screen (ui->window));
+   for (GList * node = ui->extra_windows; node; node = node->next)
+      drop_background (gtk_widget_get_screen ((GtkWidget *) node->data));
+   apply_background (ui->window);
+   for (GList * node = ui->extra_windows; node; node = node->next)
+      apply_background ((GtkWidget *) node->data);
+}
+
+ui_t * ui_create (GdkDisplay * display, const char * status, bool can_sleep,
+ bool can_quit) {
+   trace_begin ("ui_create");
    ui_t * ui = my_malloc (sizeof (ui_t));
+   trace_begin ("ui_build");
    make_window (ui, display);
    make_extra_windows (ui, display);
    make_log_in_page (ui);
    make_fail_page (ui);
    make_tool_box (ui);
    set_up_window (ui);
+   ui_update (ui, status, can_sleep, can_quit);
+   ui->shown = false;
+   ui->keyboard = ui->mouse = false;
+   ui->grab_source = 0;
+   ui->waiters = NULL;
+   trace_end ("ui_build");
+   /* realize now so that showing the UI later only has to map it */
+   trace_begin ("ui_realize");
+   gtk_widget_show_all (ui->fixed);
+   gtk_widget_realize (ui->window);
+   for (GList * node = ui->extra_windows; node; node = node->next)
+      gtk_widget_realize ((GtkWidget *) node->data);
+   trace_end ("ui_realize");
+   trace_end ("ui_create");
+   return ui;
+}
+
+static void finish_show (ui_t * ui, bool shown) {
+   if (ui->grab_source) {
+      g_source_remove (ui->grab_source);
+      ui->grab_source = 0;
+   }
+   if (! shown) {
+      unblock_x (ui);
+      hide_windows (ui);
+   }
+   ui->shown = shown;
+   trace_mark (shown ? "ui_grabbed" : "ui_not_grabbed");
+   finish_waiters (& ui->waiters, shown);
+}
+
+/* retried from the main loop, so that a client holding a grab on one display
+ * holds up neither the other displays nor anything else */
+static int grab_cb (void * data) {
+   ui_t * ui = data;
+   if (block_x (ui)) {
+      ui->grab_source = 0;
+      finish_show (ui, true);
+   } else if (++ ui->grab_tries >= config->grab_tries) {
+      ui->grab_source = 0;
+      finish_show (ui, false);
+   } else
+      return G_SOURCE_CONTINUE;
+   return G_SOURCE_REMOVE;
+}
+
+/* callback may be NULL; it may also be called before ui_show returns */
+void ui_show (ui_t * ui, show_cb callback, void * data) {
+   if (ui->shown) {
+      if (callback)
+         callback (true, data);
+      return;
+   }
+   add_waiter (& ui->waiters, callback, data);
+   if (ui->grab_source)
+      return;
+   trace_begin ("ui_show");
+   reset (ui);
    do_layout (ui);
-   ui_update (ui, status, can_quit);
    show_windows (ui);
-   GdkWindow * gdkw = gtk_widget_get_window (ui->window);
-   if (block_x (GDK_WINDOW_XDISPLAY (gdkw), GDK_WINDOW_XID (gdkw)))
-      return ui;
-   ui_destroy (ui);
-   return NULL;
+   ui->grab_tries = 0;
+   /* the first attempt nearly always succeeds, so make it right away */
+   if (block_x (ui))
+      finish_show (ui, true);
+   else {
+      grab_blocked ();
+      ui->grab_source = g_timeout_add (config->grab_interval, grab_cb, ui);
+   }
+   trace_end ("ui_show");
 }
 
-void ui_update (ui_t * ui, const char * status, bool can_quit) {
+void ui_update (ui_t * ui, const char * status, bool can_sleep, bool can_quit) {
    gtk_label_set_text ((GtkLabel *) ui->status_bar, status);
+   gtk_widget_set_sensitive (ui->sleep_button, can_sleep);
    gtk_widget_set_sensitive (ui->shut_down_button, can_quit);
    gtk_widget_set_sensitive (ui->reboot_button, can_quit);
 }
-
-void ui_destroy (ui_t * ui) {
-   GdkWindow * gdkw = gtk_widget_get_window (ui->window);
-   unblock_x (GDK_WINDOW_XDISPLAY (gdkw));
-   GdkScreen * screen = gtk_widget_get_screen (ui->window);
-   g_signal_handlers_disconnect_by_data (screen, ui);
-   gtk_widget_destroy (ui->window);
-   g_list_free_full (ui->extra_windows, (GDestroyNotify) gtk_widget_destroy);
-   free (ui);
-}
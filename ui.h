@@ -23,9 +23,14 @@
 #include <stdbool.h>
 
 typedef struct ui_s ui_t;
+typedef void (* show_cb) (bool shown, void * data);
 
-ui_t * ui_create (GdkDisplay * display, const char * status, bool can_quit);
-void ui_update (ui_t * ui, const char * status, bool can_quit);
-void ui_destroy (ui_t * ui);
+void ui_preload (void);
+void ui_set_background (const char * file);
+void ui_redraw_background (ui_t * ui);
+ui_t * ui_create (GdkDisplay * display, const char * status, bool can_sleep,
+ bool can_quit);
+void ui_show (ui_t * ui, show_cb callback, void * data);
+void ui_update (ui_t * ui, const char * status, bool can_sleep, bool can_quit);
 
 #endif
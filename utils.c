@@ -21,22 +21,20 @@
 #define _XOPEN_SOURCE
 
 #include <errno.h>
-#include <fcntl.h>
 #include <grp.h>
-#include <poll.h>
 #include <pwd.h>
-#include <shadow.h>
 #include <signal.h>
+#include <spawn.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <sys/inotify.h>
-#include <sys/stat.h>
+#include <sys/syscall.h>
 #include <sys/wait.h>
 #include <unistd.h>
 
-#include "pam.h"
-#include "screen.h"
+#include <glib.h>
+#include <glib-unix.h>
+
 #include "utils.h"
 
 void error (const char * message) {
@@ -44,6 +42,10 @@ void error (const char * message) {
    exit (1);
 }
 
+void warning (const char * message) {
+   fprintf (stderr, "%s: %s.\n", NAME, message);
+}
+
 void fail (const char * func) {
    fprintf (stderr, "%s: %s failed: %s.\n", NAME, func, strerror (errno));
    exit (1);
@@ -73,71 +75,45 @@ void my_setenv (const char * name, const char * value) {
       fail ("setenv");
 }
 
-bool exist (const char * name) {
-   struct stat buf;
-   if (! lstat (name, & buf))
-      return true;
-   if (errno != ENOENT)
-      fail2 ("stat", name);
-   return false;
-}
-
-void wait_for_exist (const char * folder, const char * file) {
-   int handle = inotify_init ();
-   if (handle < 0)
-      fail ("inotify_init");
-   if (fcntl (handle, F_SETFD, FD_CLOEXEC) < 0)
-      fail2 ("FD_CLOEXEC", "inotify");
-   if (fcntl (handle, F_SETFL, O_NONBLOCK) < 0)
-      fail2 ("O_NONBLOCK", "inotify");
-   if (inotify_add_watch (handle, folder, IN_CREATE) < 0)
-      fail2 ("inotify_add_watch", folder);
-   while (! exist (file)) {
-      struct pollfd polldata = {.fd = handle, .events = POLLIN};
-      if (poll (& polldata, 1, 1000) < 0)
-         fail2 ("poll", "inotify");
-      struct inotify_event event;
-      while (read (handle, & event, sizeof event) == sizeof event) {}
-   }
-   close (handle);
-}
-
-static void clear_signals (void) {
+void clear_signals (void) {
    sigset_t signals;
    sigemptyset (& signals);
    if (sigprocmask (SIG_SETMASK, & signals, NULL) < 0)
       fail ("sigprocmask");
 }
 
-pid_t launch (const char * const * args) {
-   pid_t process = fork ();
-   if (! process) {
-      clear_signals ();
-      execvp (args[0], (char * const *) args);
-      fail2 ("execvp", args[0]);
-   } else if (process < 0)
-      fail ("fork");
+/* posix_spawn uses vfork-style cloning, so launching a helper does not copy
+ * the page tables of the whole daemon; -1 (with a warning) on failure, which
+ * the daemon survives */
+static pid_t spawn (const char * const * args, char * const * env) {
+   posix_spawnattr_t attr;
+   posix_spawnattr_init (& attr);
+   sigset_t signals;
+   sigemptyset (& signals);
+   posix_spawnattr_setsigmask (& attr, & signals);
+   posix_spawnattr_setflags (& attr, POSIX_SPAWN_SETSIGMASK);
+   pid_t process;
+   int error = posix_spawnp (& process, args[0], NULL, & attr,
+    (char * const *) args, env);
+   posix_spawnattr_destroy (& attr);
+   if (error) {
+      SPRINTF (message, "cannot run %s: %s", args[0], strerror (error));
+      warning (message);
+      return -1;
+   }
    return process;
 }
 
-pid_t launch_set_display (const char * const * args, int display) {
-   pid_t process = fork ();
-   if (! process) {
-      SPRINTF (disp_name, ":%d", display);
-      my_setenv ("DISPLAY", disp_name);
-      clear_signals ();
-      execvp (args[0], (char * const *) args);
-      fail2 ("execvp", args[0]);
-   } else if (process < 0)
-      fail ("fork");
-   return process;
+pid_t launch (const char * const * args) {
+   return spawn (args, environ);
 }
 
-bool exited (pid_t process) {
-   int status;
-   pid_t result = waitpid (process, & status, WNOHANG);
-   return (result == process && ! WIFSTOPPED (status) && ! WIFCONTINUED
-    (status)) || (result < 0 && errno != EINTR);
+pid_t launch_set_display (const char * const * args, int display) {
+   SPRINTF (disp_name, ":%d", display);
+   char * * env = g_environ_setenv (g_get_environ (), "DISPLAY", disp_name, true);
+   pid_t process = spawn (args, env);
+   g_strfreev (env);
+   return process;
 }
 
 void wait_for_exit (pid_t process) {
@@ -146,28 +122,92 @@ void wait_for_exit (pid_t process) {
     WIFCONTINUED (status)) {}
 }
 
-void my_kill (pid_t process) {
-   if (kill (process, SIGTERM))
-      fail ("kill");
-   wait_for_exit (process);
+typedef struct {
+   pid_t process;
+   exit_cb callback;
+   void * data;
+} watch_t;
+
+static void exit_done (watch_t * watch) {
+   watch->callback (watch->process, watch->data);
+   free (watch);
 }
 
-bool check_password (const char * name, const char * password) {
-   const struct passwd * p = getpwnam (name);
-   if (! p)
-      return false;
-   const char * right = p->pw_passwd;
-   if (! strcmp (right, "x")) {
-      const struct spwd * s = getspnam (name);
-      if (! s)
-         return false;
-      right = s->sp_pwdp;
+static int pidfd_cb (int handle, GIOCondition condition, void * data) {
+   (void) condition;
+   watch_t * watch = data;
+   waitpid (watch->process, NULL, WNOHANG);
+   close (handle);
+   exit_done (watch);
+   return G_SOURCE_REMOVE;
+}
+
+static void child_watch_cb (GPid process, int status, void * data) {
+   (void) status;
+   g_spawn_close_pid (process);
+   exit_done (data);
+}
+
+static int poll_exit_cb (void * data) {
+   watch_t * watch = data;
+   if (! kill (watch->process, 0) || errno != ESRCH)
+      return G_SOURCE_CONTINUE;
+   exit_done (watch);
+   return G_SOURCE_REMOVE;
+}
+
+/* calls back from the main loop once the process has exited and been reaped;
+ * uses a pidfd where the kernel has them and a GLib child watch otherwise.
+ * A process that is not our child (one left by an earlier j-login) is reaped
+ * by someone else, and without pidfds is polled for once a second. */
+void watch_exit (pid_t process, exit_cb callback, void * data) {
+   NEW (watch_t, watch, process, callback, data);
+   int handle = -1;
+#ifdef SYS_pidfd_open
+   handle = syscall (SYS_pidfd_open, process, 0);
+#endif
+   siginfo_t info;
+   if (handle >= 0)
+      g_unix_fd_add (handle, G_IO_IN, pidfd_cb, watch);
+   else if (waitid (P_PID, process, & info, WEXITED | WNOHANG | WNOWAIT) < 0 &&
+    errno == ECHILD)
+      g_timeout_add_seconds (1, poll_exit_cb, watch);
+   else
+      g_child_watch_add (process, child_watch_cb, watch);
+}
+
+typedef struct {
+   waiter_cb callback;
+   void * data;
+} waiter_t;
+
+/* for callers waiting on something in progress, such as a greeter being
+ * shown; a NULL callback is not added */
+void add_waiter (GList * * waiters, waiter_cb callback, void * data) {
+   if (! callback)
+      return;
+   NEW (waiter_t, waiter, callback, data);
+   * waiters = g_list_append (* waiters, waiter);
+}
+
+/* the list is taken first, so a callback that waits again is left in it for
+ * the next round */
+void finish_waiters (GList * * waiters, bool success) {
+   GList * list = * waiters;
+   * waiters = NULL;
+   for (GList * node = list; node; node = node->next) {
+      waiter_t * waiter = node->data;
+      waiter->callback (success, waiter->data);
    }
-   const char * crypted = crypt (password, right);
-   return crypted && ! strcmp (crypted, right);
+   g_list_free_full (list, free);
 }
 
-void set_user (const char * user) {
+/* NULL, changing nothing, if we are not root: an unprivileged test run (see
+ * Backend in j-login.conf) keeps its own user throughout, as do the greeter,
+ * readahead and sessions it starts */
+static const struct passwd * set_ids (const char * user) {
+   if (getuid ())
+      return NULL;
    const struct passwd * p = getpwnam (user);
    if (! p)
       fail2 ("getpwnam", user);
@@ -177,6 +217,21 @@ void set_user (const char * user) {
       fail ("initgroups");
    if (setuid (p->pw_uid) < 0)
       fail ("setuid");
+   return p;
+}
+
+/* for helpers, which need no home directory; system users often have none */
+void drop_privileges (const char * user) {
+   if (! set_ids (user))
+      return;
+   if (chdir ("/") < 0)
+      fail2 ("chdir", "/");
+}
+
+void set_user (const char * user) {
+   const struct passwd * p = set_ids (user);
+   if (! p)
+      return;
    if (chdir (p->pw_dir) < 0)
       fail2 ("chdir", p->pw_dir);
    my_setenv ("USER", user);
@@ -184,26 +239,3 @@ void set_user (const char * user) {
    my_setenv ("HOME", p->pw_dir);
    my_setenv ("SHELL", p->pw_shell);
 }
-
-pid_t launch_set_user (const char * user, const char * password, int vt,
- int display, const char * const * args) {
-   pid_t process = fork ();
-   if (! process) {
-      SPRINTF (disp_name, ":%d", display);
-      my_setenv ("DISPLAY", disp_name);
-      void * pam = open_pam (user, password, vt, display);
-      pid_t process2 = fork ();
-      if (! process2) {
-         clear_signals ();
-         set_user (user);
-         execvp (args[0], (char * const *) args);
-         fail2 ("execvp", args[0]);
-      } else if (process2 < 1)
-         fail ("fork");
-      wait_for_exit (process2);
-      close_pam (pam);
-      _exit (0);
-   } else if (process < 1)
-      fail ("fork");
-   return process;
-}
@@ -23,6 +23,8 @@
 #include <stdbool.h>
 #include <sys/types.h>
 
+#include <glib.h>
+
 #define NAME "J Login"
 
 #define NEW(t, n, ...) \
@@ -33,22 +35,24 @@
  char n[snprintf (NULL, 0, __VA_ARGS__) + 1]; \
  snprintf (n, sizeof n, __VA_ARGS__)
 
+typedef void (* exit_cb) (pid_t process, void * data);
+typedef void (* waiter_cb) (bool success, void * data);
+
 void error (const char * message);
+void warning (const char * message);
 void fail (const char * func);
 void fail2 (const char * func, const char * param);
 void * my_malloc (int size);
 char * my_strdup (const char * string);
 void my_setenv (const char * name, const char * value);
-bool exist (const char * file);
-void wait_for_exist (const char * folder, const char * file);
+void clear_signals (void);
 pid_t launch (const char * const * args);
 pid_t launch_set_display (const char * const * args, int display);
-bool exited (pid_t process);
 void wait_for_exit (pid_t process);
-void my_kill (pid_t process);
-bool check_password (const char * name, const char * password);
+void watch_exit (pid_t process, exit_cb callback, void * data);
+void add_waiter (GList * * waiters, waiter_cb callback, void * data);
+void finish_waiters (GList * * waiters, bool success);
+void drop_privileges (const char * user);
 void set_user (const char * user);
-pid_t launch_set_user (const char * user, const char * password, int vt,
- int display, const char * const * args);
 
 #endif
@@ -0,0 +1,252 @@
+/*
+ * J-Login - zygote.c
+ * Copyright 2019 John Lindgren
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions, and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions, and the following disclaimer in the documentation
+ *    provided with the distribution.
+ *
+ * This software is provided "as is" and without any warranty, express or
+ * implied. In no event shall the authors be liable for any damages arising from
+ * the use of this software.
+ */
+
+/* Sessions are started from a small helper process that is forked before GTK
+ * is initialized.  For each login it forks a child that authenticates, reports
+ * back over a socket of its own, and then opens the PAM session and runs
+ * j-session when told which console to use.  The socket stays open until the
+ * session ends. */
+
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <glib.h>
+#include <glib-unix.h>
+
+#include "metrics.h"
+#include "pam.h"
+#include "readahead.h"
+#include "trace.h"
+#include "zygote.h"
+
+typedef struct {
+   char user[256], password[512];
+} request_t;
+
+typedef struct {
+   bool success;
+   pid_t process;
+} reply_t;
+
+typedef struct {
+   int vt, display;
+} start_t;
+
+struct session_s {
+   int handle;
+   pid_t process;
+   int64_t start;
+   auth_cb auth_callback;
+   exit_cb exit_callback;
+   void * data;
+};
+
+static int zygote_handle = -1;
+
+static bool send_fd (int handle, const void * buf, int size, int fd) {
+   struct iovec iov = {(void *) buf, size};
+   char control[CMSG_SPACE (sizeof (int))];
+   struct msghdr msg = {.msg_iov = & iov, .msg_iovlen = 1, .msg_control =
+    control, .msg_controllen = sizeof control};
+   struct cmsghdr * cmsg = CMSG_FIRSTHDR (& msg);
+   cmsg->cmsg_level = SOL_SOCKET;
+   cmsg->cmsg_type = SCM_RIGHTS;
+   cmsg->cmsg_len = CMSG_LEN (sizeof (int));
+   memcpy (CMSG_DATA (cmsg), & fd, sizeof (int));
+   return sendmsg (handle, & msg, MSG_NOSIGNAL) == size;
+}
+
+static bool receive_fd (int handle, void * buf, int size, int * fd) {
+   struct iovec iov = {buf, size};
+   char control[CMSG_SPACE (sizeof (int))];
+   struct msghdr msg = {.msg_iov = & iov, .msg_iovlen = 1, .msg_control =
+    control, .msg_controllen = sizeof control};
+   if (recvmsg (handle, & msg, MSG_CMSG_CLOEXEC) != size)
+      return false;
+   struct cmsghdr * cmsg = CMSG_FIRSTHDR (& msg);
+   if (! cmsg || cmsg->cmsg_type != SCM_RIGHTS)
+      return false;
+   memcpy (fd, CMSG_DATA (cmsg), sizeof (int));
+   return true;
+}
+
+static void run_session (void * pam, const char * user, const start_t * start) {
+   SPRINTF (disp_name, ":%d", start->display);
+   my_setenv ("DISPLAY", disp_name);
+   open_pam (pam, start->vt, start->display);
+   pid_t process = fork ();
+   if (! process) {
+      clear_signals ();
+      set_user (user);
+      trace_mark ("session_exec");
+      static const char * const args[] = {"j-session", NULL};
+      execvp (args[0], (char * const *) args);
+      fail2 ("execvp", args[0]);
+   } else if (process < 0)
+      fail ("fork");
+   wait_for_exit (process);
+   close_pam (pam);
+}
+
+/* in a grandchild, reaped by init, that must not hold the session socket */
+static void detach (void (* func) (const char * user), const char * user,
+ int handle) {
+   pid_t process = fork ();
+   if (! process) {
+      close (handle);
+      if (! fork ())
+         func (user);
+      _exit (0);
+   }
+   if (process > 0)
+      wait_for_exit (process);
+}
+
+static void run_login (int handle, request_t * request) {
+   signal (SIGCHLD, SIG_DFL);
+   void * pam = start_pam (request->user, request->password);
+   memset (request->password, 0, sizeof request->password);
+   /* warms the page cache while the daemon gets the console ready; a failed
+    * login (or a made-up user name) reads nothing */
+   if (pam)
+      detach (readahead_run, request->user, handle);
+   reply_t reply = {pam != NULL, getpid ()};
+   start_t start;
+   if (! pam || send (handle, & reply, sizeof reply, MSG_NOSIGNAL) != sizeof
+    reply || recv (handle, & start, sizeof start, 0) != sizeof start) {
+      if (pam)
+         end_pam (pam);
+      _exit (0);
+   }
+   detach (readahead_record, request->user, handle);
+   run_session (pam, request->user, & start);
+   _exit (0);
+}
+
+static void zygote_main (int control) {
+   /* children are never waited for here */
+   signal (SIGCHLD, SIG_IGN);
+   request_t request;
+   int handle;
+   while (receive_fd (control, & request, sizeof request, & handle)) {
+      /* if the fork fails, the closed socket reports the login as failed */
+      if (! fork ()) {
+         close (control);
+         run_login (handle, & request);
+      }
+      memset (request.password, 0, sizeof request.password);
+      close (handle);
+   }
+   _exit (0);
+}
+
+/* must be called before GTK or any other threads are started */
+static pid_t zygote_process;
+
+void zygote_start (void) {
+   int fds[2];
+   if (socketpair (AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, fds) < 0)
+      fail ("socketpair");
+   pid_t process = fork ();
+   if (! process) {
+      close (fds[0]);
+      zygote_main (fds[1]);
+   } else if (process < 0)
+      fail ("fork");
+   close (fds[1]);
+   zygote_handle = fds[0];
+   zygote_process = process;
+}
+
+/* before a re-exec, so that the zygote is not left behind as a zombie; logins
+ * already forked from it carry on */
+void zygote_stop (void) {
+   close (zygote_handle);
+   wait_for_exit (zygote_process);
+}
+
+void session_cancel (session_t * session) {
+   close (session->handle);
+   free (session);
+}
+
+static int auth_reply_cb (int handle, GIOCondition condition, void * data) {
+   (void) condition;
+   session_t * session = data;
+   auth_cb callback = session->auth_callback;
+   void * callback_data = session->data;
+   metrics_observe (HIST_AUTH, session->start);
+   reply_t reply;
+   if (recv (handle, & reply, sizeof reply, 0) == sizeof reply && reply.success)
+      session->process = reply.process;
+   else {
+      session_cancel (session);
+      session = NULL;
+   }
+   callback (session, callback_data);
+   return G_SOURCE_REMOVE;
+}
+
+void authenticate_async (const char * name, const char * password,
+ auth_cb callback, void * data) {
+   request_t request;
+   if (strlen (name) >= sizeof request.user || strlen (password) >= sizeof
+    request.password) {
+      callback (NULL, data);
+      return;
+   }
+   memset (& request, 0, sizeof request);
+   strcpy (request.user, name);
+   strcpy (request.password, password);
+   int fds[2];
+   if (socketpair (AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, fds) < 0)
+      fail ("socketpair");
+   if (! send_fd (zygote_handle, & request, sizeof request, fds[1]))
+      fail ("sendmsg");
+   memset (request.password, 0, sizeof request.password);
+   close (fds[1]);
+   NEW (session_t, session, fds[0], -1, metrics_now (), callback, NULL, data);
+   g_unix_fd_add (fds[0], G_IO_IN | G_IO_HUP | G_IO_ERR, auth_reply_cb, session);
+}
+
+/* the child writes nothing more, so any event means the session has ended */
+static int session_end_cb (int handle, GIOCondition condition, void * data) {
+   (void) handle;
+   (void) condition;
+   session_t * session = data;
+   session->exit_callback (session->process, session->data);
+   session_cancel (session);
+   return G_SOURCE_REMOVE;
+}
+
+pid_t session_start (session_t * session, int vt, int display,
+ exit_cb callback, void * data) {
+   start_t start = {vt, display};
+   /* if the child is gone, the watch below reports it */
+   send (session->handle, & start, sizeof start, MSG_NOSIGNAL);
+   session->exit_callback = callback;
+   session->data = data;
+   g_unix_fd_add (session->handle, G_IO_IN | G_IO_HUP | G_IO_ERR,
+    session_end_cb, session);
+   return session->process;
+}
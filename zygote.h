@@ -0,0 +1,38 @@
+/*
+ * J-Login - zygote.h
+ * Copyright 2019 John Lindgren
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions, and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions, and the following disclaimer in the documentation
+ *    provided with the distribution.
+ *
+ * This software is provided "as is" and without any warranty, express or
+ * implied. In no event shall the authors be liable for any damages arising from
+ * the use of this software.
+ */
+
+#ifndef JLOGIN_ZYGOTE_H
+#define JLOGIN_ZYGOTE_H
+
+#include <sys/types.h>
+
+#include "utils.h"
+
+typedef struct session_s session_t;
+typedef void (* auth_cb) (session_t * session, void * data);
+
+void zygote_start (void);
+void zygote_stop (void);
+void authenticate_async (const char * name, const char * password,
+ auth_cb callback, void * data);
+pid_t session_start (session_t * session, int vt, int display,
+ exit_cb callback, void * data);
+void session_cancel (session_t * session);
+
+#endif